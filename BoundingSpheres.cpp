@@ -0,0 +1,112 @@
+#include "BoundingSpheres.hpp"
+#include "ThreadPool.hpp"
+#include <xmmintrin.h>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+// Spheres per job when a batch is split across threads
+const size_t kSpheresPerJob = 4096;
+
+const float*
+xformAt(const glm::mat4x3* xforms,
+        size_t xform_stride,
+        size_t index)
+{
+    return (const float*)((const char*)xforms + index * xform_stride);
+}
+
+void
+transformRange(const glm::mat4x3* xforms,
+               size_t xform_stride,
+               const glm::vec4* local_spheres,
+               size_t first,
+               size_t end,
+               glm::vec4* world_spheres,
+               float* scales)
+{
+    size_t i = first;
+    for (; i + 4 <= end; i += 4) {
+        // Gather so each register holds one transform element of all
+        // four models; element 3c+r is row r of column c
+        const float* m0 = xformAt(xforms, xform_stride, i);
+        const float* m1 = xformAt(xforms, xform_stride, i + 1);
+        const float* m2 = xformAt(xforms, xform_stride, i + 2);
+        const float* m3 = xformAt(xforms, xform_stride, i + 3);
+        __m128 e[12];
+        for (int k=0; k<12; ++k) {
+            e[k] = _mm_setr_ps(m0[k], m1[k], m2[k], m3[k]);
+        }
+
+        __m128 x = _mm_loadu_ps(&local_spheres[i].x);
+        __m128 y = _mm_loadu_ps(&local_spheres[i + 1].x);
+        __m128 z = _mm_loadu_ps(&local_spheres[i + 2].x);
+        __m128 r = _mm_loadu_ps(&local_spheres[i + 3].x);
+        _MM_TRANSPOSE4_PS(x, y, z, r);
+
+        __m128 wx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[0], x), _mm_mul_ps(e[3], y)),
+                               _mm_add_ps(_mm_mul_ps(e[6], z), e[9]));
+        __m128 wy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[1], x), _mm_mul_ps(e[4], y)),
+                               _mm_add_ps(_mm_mul_ps(e[7], z), e[10]));
+        __m128 wz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[2], x), _mm_mul_ps(e[5], y)),
+                               _mm_add_ps(_mm_mul_ps(e[8], z), e[11]));
+
+        __m128 scale_sq = _mm_setzero_ps();
+        for (int c=0; c<3; ++c) {
+            const __m128 length_sq
+                = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[3*c], e[3*c]),
+                                        _mm_mul_ps(e[3*c+1], e[3*c+1])),
+                             _mm_mul_ps(e[3*c+2], e[3*c+2]));
+            scale_sq = _mm_max_ps(scale_sq, length_sq);
+        }
+        const __m128 scale = _mm_sqrt_ps(scale_sq);
+        __m128 wr = _mm_mul_ps(r, scale);
+
+        _MM_TRANSPOSE4_PS(wx, wy, wz, wr);
+        _mm_storeu_ps(&world_spheres[i].x, wx);
+        _mm_storeu_ps(&world_spheres[i + 1].x, wy);
+        _mm_storeu_ps(&world_spheres[i + 2].x, wz);
+        _mm_storeu_ps(&world_spheres[i + 3].x, wr);
+        _mm_storeu_ps(scales + i, scale);
+    }
+
+    for (; i < end; ++i) {
+        const glm::mat4x3& xform
+            = *(const glm::mat4x3*)xformAt(xforms, xform_stride, i);
+        const glm::vec4& sphere = local_spheres[i];
+        const glm::vec3 centre = xform * glm::vec4(glm::vec3(sphere), 1.f);
+        const float scale = sqrtf(std::max(glm::dot(xform[0], xform[0]),
+                                  std::max(glm::dot(xform[1], xform[1]),
+                                           glm::dot(xform[2], xform[2]))));
+        world_spheres[i] = glm::vec4(centre, sphere.w * scale);
+        scales[i] = scale;
+    }
+}
+
+} // namespace
+
+void
+transformBoundingSpheres(const glm::mat4x3* xforms,
+                         size_t xform_stride,
+                         const glm::vec4* local_spheres,
+                         size_t count,
+                         glm::vec4* world_spheres,
+                         float* scales,
+                         ThreadPool* pool)
+{
+    if (pool == nullptr || count <= kSpheresPerJob) {
+        transformRange(xforms, xform_stride, local_spheres, 0, count,
+                       world_spheres, scales);
+        return;
+    }
+
+    const int job_count = (count + kSpheresPerJob - 1) / kSpheresPerJob;
+    pool->parallelFor(job_count, [&](int job) {
+        const size_t first = job * kSpheresPerJob;
+        transformRange(xforms, xform_stride, local_spheres, first,
+                       std::min(first + kSpheresPerJob, count),
+                       world_spheres, scales);
+    });
+}
@@ -0,0 +1,28 @@
+/*
+ @file      BoundingSpheres.hpp
+ */
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstddef>
+
+class ThreadPool;
+
+/**
+ Transforms local bounding spheres, held as centre and radius in a vec4,
+ to world space, four at a time with SSE. Each radius is scaled by its
+ transform's largest axis scale, which is also written to scales.
+ @param xforms        The first model transform.
+ @param xform_stride  Bytes from one transform to the next, so transforms
+                      can be read in place from an array of structs.
+ @param pool          Splits large batches across its workers if given.
+ */
+void
+transformBoundingSpheres(const glm::mat4x3* xforms,
+                         size_t xform_stride,
+                         const glm::vec4* local_spheres,
+                         size_t count,
+                         glm::vec4* world_spheres,
+                         float* scales,
+                         ThreadPool* pool = nullptr);
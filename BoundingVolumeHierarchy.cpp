@@ -0,0 +1,417 @@
+#include "BoundingVolumeHierarchy.hpp"
+#include "FrustumCulling.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+
+// Leaves hold at most one SSE batch of items
+const unsigned int kMaxLeafItems = 4;
+const int kBinCount = 16;
+
+// Beyond this depth nodes are split at the median, bounding the depth of
+// any tree over 2^32 items within the traversal stacks
+const int kMaxHeuristicDepth = 64;
+const int kStackSize = 128;
+
+float
+surfaceArea(const glm::vec3& box_min,
+            const glm::vec3& box_max)
+{
+    const glm::vec3 size = box_max - box_min;
+    return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+struct Bin
+{
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    unsigned int count;
+
+    Bin() : bounds_min(FLT_MAX), bounds_max(-FLT_MAX), count(0) {}
+};
+
+} // namespace
+
+BoundingVolumeHierarchy::
+BoundingVolumeHierarchy()
+{
+}
+
+void BoundingVolumeHierarchy::
+build(const std::vector<glm::vec3>& box_mins,
+      const std::vector<glm::vec3>& box_maxs)
+{
+    const unsigned int count = box_mins.size();
+    nodes_.clear();
+    items_.resize(count);
+    std::vector<glm::vec3> centroids(count);
+    for (unsigned int i=0; i<count; ++i) {
+        items_[i] = i;
+        centroids[i] = (box_mins[i] + box_maxs[i]) * 0.5f;
+    }
+
+    if (count > 0) {
+        nodes_.reserve(2 * count);
+        nodes_.push_back(Node());
+        buildNode(0, 0, count, 0, box_mins, box_maxs, centroids);
+    }
+
+    item_centres_.resize(count);
+    item_extents_.resize(count);
+    for (unsigned int i=0; i<count; ++i) {
+        const unsigned int item = items_[i];
+        item_centres_[i] = centroids[item];
+        item_extents_[i] = (box_maxs[item] - box_mins[item]) * 0.5f;
+    }
+}
+
+void BoundingVolumeHierarchy::
+buildNode(unsigned int node_index,
+          unsigned int first_item,
+          unsigned int item_count,
+          int depth,
+          const std::vector<glm::vec3>& box_mins,
+          const std::vector<glm::vec3>& box_maxs,
+          const std::vector<glm::vec3>& centroids)
+{
+    glm::vec3 bounds_min(FLT_MAX), bounds_max(-FLT_MAX);
+    glm::vec3 centroid_min(FLT_MAX), centroid_max(-FLT_MAX);
+    for (unsigned int i=first_item; i<first_item+item_count; ++i) {
+        const unsigned int item = items_[i];
+        bounds_min = glm::min(bounds_min, box_mins[item]);
+        bounds_max = glm::max(bounds_max, box_maxs[item]);
+        centroid_min = glm::min(centroid_min, centroids[item]);
+        centroid_max = glm::max(centroid_max, centroids[item]);
+    }
+
+    Node& node = nodes_[node_index];
+    node.bounds_min = bounds_min;
+    node.bounds_max = bounds_max;
+    node.first_item = first_item;
+    node.item_count = item_count;
+    node.right_child = 0;
+    if (item_count <= kMaxLeafItems) {
+        return;
+    }
+
+    // Bin the centroids along the axis they spread furthest over
+    const glm::vec3 spread = centroid_max - centroid_min;
+    int axis = 0;
+    if (spread.y > spread[axis]) axis = 1;
+    if (spread.z > spread[axis]) axis = 2;
+
+    unsigned int split = first_item;
+    if (spread[axis] > 0.f && depth < kMaxHeuristicDepth) {
+        Bin bins[kBinCount];
+        const float bin_scale = kBinCount / spread[axis];
+        auto binIndex = [&](unsigned int item) {
+            const int bin = (int)((centroids[item][axis] - centroid_min[axis])
+                                  * bin_scale);
+            return std::min(bin, kBinCount - 1);
+        };
+        for (unsigned int i=first_item; i<first_item+item_count; ++i) {
+            const unsigned int item = items_[i];
+            Bin& bin = bins[binIndex(item)];
+            bin.bounds_min = glm::min(bin.bounds_min, box_mins[item]);
+            bin.bounds_max = glm::max(bin.bounds_max, box_maxs[item]);
+            ++bin.count;
+        }
+
+        // Sweep from the right recording the cost of everything right of
+        // each boundary, then from the left to find the cheapest boundary
+        float right_cost[kBinCount];
+        Bin right;
+        for (int b=kBinCount-1; b>0; --b) {
+            right.bounds_min = glm::min(right.bounds_min, bins[b].bounds_min);
+            right.bounds_max = glm::max(right.bounds_max, bins[b].bounds_max);
+            right.count += bins[b].count;
+            right_cost[b] = right.count == 0 ? 0.f
+                : right.count * surfaceArea(right.bounds_min, right.bounds_max);
+        }
+        Bin left;
+        float best_cost = FLT_MAX;
+        int best_boundary = -1;
+        for (int b=1; b<kBinCount; ++b) {
+            left.bounds_min = glm::min(left.bounds_min, bins[b-1].bounds_min);
+            left.bounds_max = glm::max(left.bounds_max, bins[b-1].bounds_max);
+            left.count += bins[b-1].count;
+            if (left.count == 0 || left.count == item_count) {
+                continue;
+            }
+            const float cost = left.count * surfaceArea(left.bounds_min, left.bounds_max)
+                             + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_boundary = b;
+            }
+        }
+
+        if (best_boundary > 0) {
+            split = std::partition(items_.begin() + first_item,
+                                   items_.begin() + first_item + item_count,
+                                   [&](unsigned int item) {
+                                       return binIndex(item) < best_boundary;
+                                   }) - items_.begin();
+        }
+    }
+
+    // Fall back to a median split when binning could not separate them
+    if (split == first_item || split == first_item + item_count) {
+        split = first_item + item_count / 2;
+        std::nth_element(items_.begin() + first_item,
+                         items_.begin() + split,
+                         items_.begin() + first_item + item_count,
+                         [&](unsigned int a, unsigned int b) {
+                             return centroids[a][axis] < centroids[b][axis];
+                         });
+    }
+
+    // The left child directly follows its parent, so the right child is
+    // placed after the whole left subtree
+    const unsigned int left_index = nodes_.size();
+    nodes_.push_back(Node());
+    buildNode(left_index, first_item, split - first_item, depth + 1,
+              box_mins, box_maxs, centroids);
+    const unsigned int right_index = nodes_.size();
+    nodes_.push_back(Node());
+    buildNode(right_index, split, first_item + item_count - split, depth + 1,
+              box_mins, box_maxs, centroids);
+    nodes_[node_index].right_child = right_index;
+}
+
+void BoundingVolumeHierarchy::
+refit(const std::vector<glm::vec3>& box_mins,
+      const std::vector<glm::vec3>& box_maxs)
+{
+    for (unsigned int i=0; i<items_.size(); ++i) {
+        const unsigned int item = items_[i];
+        item_centres_[i] = (box_mins[item] + box_maxs[item]) * 0.5f;
+        item_extents_[i] = (box_maxs[item] - box_mins[item]) * 0.5f;
+    }
+
+    // Children always come after their parent, so walking backwards
+    // refits every child before the node above it
+    for (size_t n=nodes_.size(); n-- > 0;) {
+        Node& node = nodes_[n];
+        if (node.right_child == 0) {
+            node.bounds_min = glm::vec3(FLT_MAX);
+            node.bounds_max = glm::vec3(-FLT_MAX);
+            for (unsigned int i=node.first_item;
+                 i<node.first_item+node.item_count; ++i) {
+                node.bounds_min = glm::min(node.bounds_min,
+                                           item_centres_[i] - item_extents_[i]);
+                node.bounds_max = glm::max(node.bounds_max,
+                                           item_centres_[i] + item_extents_[i]);
+            }
+        } else {
+            const Node& left = nodes_[n + 1];
+            const Node& right = nodes_[node.right_child];
+            node.bounds_min = glm::min(left.bounds_min, right.bounds_min);
+            node.bounds_max = glm::max(left.bounds_max, right.bounds_max);
+        }
+    }
+}
+
+size_t BoundingVolumeHierarchy::
+itemCount() const
+{
+    return items_.size();
+}
+
+size_t BoundingVolumeHierarchy::
+nodeCount() const
+{
+    return nodes_.size();
+}
+
+size_t BoundingVolumeHierarchy::
+cullFrustum(const glm::vec4 planes[6],
+            unsigned char* visible) const
+{
+    std::fill(visible, visible + items_.size(), 0);
+    if (nodes_.empty()) {
+        return 0;
+    }
+
+    // Each stack entry carries the planes its box still straddles, as
+    // planes a parent lies wholly inside need not be tested again
+    unsigned int node_stack[kStackSize];
+    unsigned int mask_stack[kStackSize];
+    int stack_size = 0;
+    node_stack[stack_size] = 0;
+    mask_stack[stack_size++] = 0x3f;
+
+    size_t visible_count = 0;
+    while (stack_size > 0) {
+        --stack_size;
+        const unsigned int node_index = node_stack[stack_size];
+        const Node& node = nodes_[node_index];
+        unsigned int mask = mask_stack[stack_size];
+
+        const glm::vec3 centre = (node.bounds_min + node.bounds_max) * 0.5f;
+        const glm::vec3 extent = (node.bounds_max - node.bounds_min) * 0.5f;
+        bool outside = false;
+        for (int p=0; p<6 && !outside; ++p) {
+            if ((mask & (1u << p)) == 0) {
+                continue;
+            }
+            const glm::vec3 normal = glm::vec3(planes[p]);
+            const float distance = glm::dot(normal, centre) + planes[p].w;
+            const float radius = fabsf(normal.x) * extent.x
+                               + fabsf(normal.y) * extent.y
+                               + fabsf(normal.z) * extent.z;
+            if (distance < -radius) {
+                outside = true;
+            } else if (distance >= radius) {
+                mask &= ~(1u << p);
+            }
+        }
+        if (outside) {
+            continue;
+        }
+
+        if (mask == 0) {
+            // Wholly inside, so everything below is visible untested
+            for (unsigned int i=node.first_item;
+                 i<node.first_item+node.item_count; ++i) {
+                visible[items_[i]] = 1;
+            }
+            visible_count += node.item_count;
+        } else if (node.right_child == 0) {
+            unsigned char leaf_visible[kMaxLeafItems];
+            visible_count += cullBoxes(&item_centres_[node.first_item],
+                                       &item_extents_[node.first_item],
+                                       node.item_count, planes, leaf_visible);
+            for (unsigned int i=0; i<node.item_count; ++i) {
+                visible[items_[node.first_item + i]] = leaf_visible[i];
+            }
+        } else {
+            node_stack[stack_size] = node.right_child;
+            mask_stack[stack_size++] = mask;
+            node_stack[stack_size] = node_index + 1;
+            mask_stack[stack_size++] = mask;
+        }
+    }
+    return visible_count;
+}
+
+void BoundingVolumeHierarchy::
+queryBox(glm::vec3 box_min,
+         glm::vec3 box_max,
+         std::vector<unsigned int>& items) const
+{
+    if (nodes_.empty()) {
+        return;
+    }
+    const glm::vec3 query_centre = (box_min + box_max) * 0.5f;
+    const glm::vec3 query_extent = (box_max - box_min) * 0.5f;
+
+    unsigned int stack[kStackSize];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const unsigned int node_index = stack[--stack_size];
+        const Node& node = nodes_[node_index];
+        if (glm::any(glm::lessThan(node.bounds_max, box_min))
+            || glm::any(glm::greaterThan(node.bounds_min, box_max))) {
+            continue;
+        }
+
+        const bool contained = glm::all(glm::greaterThanEqual(node.bounds_min, box_min))
+                            && glm::all(glm::lessThanEqual(node.bounds_max, box_max));
+        if (contained || node.right_child == 0) {
+            for (unsigned int i=node.first_item;
+                 i<node.first_item+node.item_count; ++i) {
+                const glm::vec3 separation
+                    = glm::abs(item_centres_[i] - query_centre)
+                      - item_extents_[i] - query_extent;
+                if (contained || !glm::any(glm::greaterThan(separation, glm::vec3(0.f)))) {
+                    items.push_back(items_[i]);
+                }
+            }
+        } else {
+            stack[stack_size++] = node.right_child;
+            stack[stack_size++] = node_index + 1;
+        }
+    }
+}
+
+int BoundingVolumeHierarchy::
+raycast(glm::vec3 origin,
+        glm::vec3 direction,
+        float& distance,
+        std::function<float(unsigned int, float)> hit_test) const
+{
+    if (nodes_.empty()) {
+        return -1;
+    }
+    const glm::vec3 inverse_direction = 1.f / direction;
+
+    // Slab test, giving where the ray enters the box or FLT_MAX if it
+    // misses within the current distance
+    auto enterBox = [&](const glm::vec3& box_min, const glm::vec3& box_max) {
+        const glm::vec3 t0 = (box_min - origin) * inverse_direction;
+        const glm::vec3 t1 = (box_max - origin) * inverse_direction;
+        const glm::vec3 t_near = glm::min(t0, t1);
+        const glm::vec3 t_far = glm::max(t0, t1);
+        const float enter = std::max(std::max(t_near.x, t_near.y),
+                                     std::max(t_near.z, 0.f));
+        const float leave = std::min(std::min(t_far.x, t_far.y), t_far.z);
+        return enter <= leave && enter < distance ? enter : FLT_MAX;
+    };
+
+    int nearest_item = -1;
+    unsigned int stack[kStackSize];
+    float enter_stack[kStackSize];
+    int stack_size = 0;
+    stack[stack_size] = 0;
+    enter_stack[stack_size++] = enterBox(nodes_[0].bounds_min, nodes_[0].bounds_max);
+
+    while (stack_size > 0) {
+        --stack_size;
+        if (enter_stack[stack_size] >= distance) {
+            continue;
+        }
+        const unsigned int node_index = stack[stack_size];
+        const Node& node = nodes_[node_index];
+
+        if (node.right_child == 0) {
+            for (unsigned int i=node.first_item;
+                 i<node.first_item+node.item_count; ++i) {
+                if (enterBox(item_centres_[i] - item_extents_[i],
+                             item_centres_[i] + item_extents_[i]) == FLT_MAX) {
+                    continue;
+                }
+                const float hit = hit_test(items_[i], distance);
+                if (hit < distance) {
+                    distance = hit;
+                    nearest_item = items_[i];
+                }
+            }
+            continue;
+        }
+
+        // Push the farther child first so the nearer is visited first
+        const Node& left = nodes_[node_index + 1];
+        const Node& right = nodes_[node.right_child];
+        const float left_enter = enterBox(left.bounds_min, left.bounds_max);
+        const float right_enter = enterBox(right.bounds_min, right.bounds_max);
+        const bool left_first = left_enter <= right_enter;
+        const unsigned int first = left_first ? node_index + 1 : node.right_child;
+        const unsigned int second = left_first ? node.right_child : node_index + 1;
+        const float first_enter = left_first ? left_enter : right_enter;
+        const float second_enter = left_first ? right_enter : left_enter;
+        if (second_enter != FLT_MAX) {
+            stack[stack_size] = second;
+            enter_stack[stack_size++] = second_enter;
+        }
+        if (first_enter != FLT_MAX) {
+            stack[stack_size] = first;
+            enter_stack[stack_size++] = first_enter;
+        }
+    }
+    return nearest_item;
+}
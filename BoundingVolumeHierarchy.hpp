@@ -0,0 +1,108 @@
+/*
+ @file      BoundingVolumeHierarchy.hpp
+ */
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+/**
+ A tree of axis-aligned boxes over a set of items, themselves given as
+ boxes, for culling and spatial queries that skip whole groups of items.
+ Nodes are stored depth first, so a node's left child directly follows it
+ and the items under any node are a contiguous range.
+ */
+class BoundingVolumeHierarchy
+{
+public:
+
+    BoundingVolumeHierarchy();
+
+    /**
+     Builds the tree top down, splitting each node where a binned surface
+     area heuristic estimates the cheapest traversal.
+     */
+    void
+    build(const std::vector<glm::vec3>& box_mins,
+          const std::vector<glm::vec3>& box_maxs);
+
+    /**
+     Recomputes every node's box from the items' new boxes, keeping the
+     tree's shape. Quality degrades as items move far, when a rebuild is
+     better.
+     */
+    void
+    refit(const std::vector<glm::vec3>& box_mins,
+          const std::vector<glm::vec3>& box_maxs);
+
+    size_t
+    itemCount() const;
+
+    size_t
+    nodeCount() const;
+
+    /**
+     Sets visible[item] to 1 for items whose box is at least partly inside
+     all six inward facing planes, otherwise 0. A subtree wholly inside is
+     accepted, and one wholly outside a plane rejected, without visiting
+     its items.
+     @return  Number of visible items.
+     */
+    size_t
+    cullFrustum(const glm::vec4 planes[6],
+                unsigned char* visible) const;
+
+    /**
+     Appends the items whose boxes overlap the given box.
+     */
+    void
+    queryBox(glm::vec3 box_min,
+             glm::vec3 box_max,
+             std::vector<unsigned int>& items) const;
+
+    /**
+     Visits items whose box the ray enters within distance, nearer nodes
+     first. hit_test(item, distance) returns where along the ray the item
+     is hit, or at least distance for a miss; hits shorten the ray.
+     @param distance  Limit of the ray, in units of direction's length, and
+                      receives the nearest hit's distance.
+     @return  The nearest item hit, or -1.
+     */
+    int
+    raycast(glm::vec3 origin,
+            glm::vec3 direction,
+            float& distance,
+            std::function<float(unsigned int, float)> hit_test) const;
+
+private:
+
+    struct Node
+    {
+        glm::vec3 bounds_min;
+        glm::vec3 bounds_max;
+        // range of items_ under this node
+        unsigned int first_item;
+        unsigned int item_count;
+        // zero for a leaf; the left child is always the next node
+        unsigned int right_child;
+    };
+
+    void
+    buildNode(unsigned int node_index,
+              unsigned int first_item,
+              unsigned int item_count,
+              int depth,
+              const std::vector<glm::vec3>& box_mins,
+              const std::vector<glm::vec3>& box_maxs,
+              const std::vector<glm::vec3>& centroids);
+
+    std::vector<Node> nodes_;
+    // item indices in leaf order
+    std::vector<unsigned int> items_;
+    // item boxes as centre and half extent, in leaf order
+    std::vector<glm::vec3> item_centres_;
+    std::vector<glm::vec3> item_extents_;
+};
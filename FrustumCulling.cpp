@@ -0,0 +1,94 @@
+#include "FrustumCulling.hpp"
+#include <xmmintrin.h>
+#include <cmath>
+
+namespace
+{
+
+bool
+boxIsVisible(const glm::vec3& centre,
+             const glm::vec3& extent,
+             const glm::vec4 planes[6])
+{
+    for (int p=0; p<6; ++p) {
+        const glm::vec3 normal = glm::vec3(planes[p]);
+        const float distance = glm::dot(normal, centre) + planes[p].w;
+        const float radius = fabsf(normal.x) * extent.x
+                           + fabsf(normal.y) * extent.y
+                           + fabsf(normal.z) * extent.z;
+        if (distance < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+size_t
+cullBoxes(const glm::vec3* centres,
+          const glm::vec3* extents,
+          size_t count,
+          const glm::vec4 planes[6],
+          unsigned char* visible)
+{
+    // Each plane's components are splatted once, along with their
+    // absolute values for projecting the extents onto the normal
+    __m128 plane_x[6], plane_y[6], plane_z[6], plane_w[6];
+    __m128 abs_x[6], abs_y[6], abs_z[6];
+    for (int p=0; p<6; ++p) {
+        plane_x[p] = _mm_set1_ps(planes[p].x);
+        plane_y[p] = _mm_set1_ps(planes[p].y);
+        plane_z[p] = _mm_set1_ps(planes[p].z);
+        plane_w[p] = _mm_set1_ps(planes[p].w);
+        abs_x[p] = _mm_set1_ps(fabsf(planes[p].x));
+        abs_y[p] = _mm_set1_ps(fabsf(planes[p].y));
+        abs_z[p] = _mm_set1_ps(fabsf(planes[p].z));
+    }
+
+    size_t visible_count = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 cx = _mm_setr_ps(centres[i].x, centres[i+1].x,
+                                      centres[i+2].x, centres[i+3].x);
+        const __m128 cy = _mm_setr_ps(centres[i].y, centres[i+1].y,
+                                      centres[i+2].y, centres[i+3].y);
+        const __m128 cz = _mm_setr_ps(centres[i].z, centres[i+1].z,
+                                      centres[i+2].z, centres[i+3].z);
+        const __m128 ex = _mm_setr_ps(extents[i].x, extents[i+1].x,
+                                      extents[i+2].x, extents[i+3].x);
+        const __m128 ey = _mm_setr_ps(extents[i].y, extents[i+1].y,
+                                      extents[i+2].y, extents[i+3].y);
+        const __m128 ez = _mm_setr_ps(extents[i].z, extents[i+1].z,
+                                      extents[i+2].z, extents[i+3].z);
+
+        // A box is outside when its centre is further behind any plane
+        // than its extent reaches along that plane's normal
+        __m128 outside = _mm_setzero_ps();
+        for (int p=0; p<6; ++p) {
+            const __m128 distance
+                = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane_x[p], cx),
+                                        _mm_mul_ps(plane_y[p], cy)),
+                             _mm_add_ps(_mm_mul_ps(plane_z[p], cz), plane_w[p]));
+            const __m128 radius
+                = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abs_x[p], ex),
+                                        _mm_mul_ps(abs_y[p], ey)),
+                             _mm_mul_ps(abs_z[p], ez));
+            outside = _mm_or_ps(outside,
+                                _mm_cmplt_ps(_mm_add_ps(distance, radius),
+                                             _mm_setzero_ps()));
+        }
+
+        const int outside_mask = _mm_movemask_ps(outside);
+        for (int k=0; k<4; ++k) {
+            visible[i + k] = (outside_mask & (1 << k)) ? 0 : 1;
+            visible_count += visible[i + k];
+        }
+    }
+
+    for (; i < count; ++i) {
+        visible[i] = boxIsVisible(centres[i], extents[i], planes) ? 1 : 0;
+        visible_count += visible[i];
+    }
+    return visible_count;
+}
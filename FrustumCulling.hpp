@@ -0,0 +1,23 @@
+/*
+ @file      FrustumCulling.hpp
+ */
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstddef>
+
+/**
+ Tests axis-aligned boxes, given as centre and half extent, against the
+ six planes of a frustum four boxes at a time with SSE. Planes face
+ inwards and need not be normalised.
+ @param visible  Receives 1 for each box at least partly inside every
+                 plane, otherwise 0.
+ @return  Number of visible boxes.
+ */
+size_t
+cullBoxes(const glm::vec3* centres,
+          const glm::vec3* extents,
+          size_t count,
+          const glm::vec4 planes[6],
+          unsigned char* visible);
@@ -0,0 +1,129 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::
+MappedFile() : data_(nullptr),
+               size_(0)
+#ifdef _WIN32
+               , file_handle_(INVALID_HANDLE_VALUE),
+               mapping_handle_(nullptr)
+#else
+               , file_descriptor_(-1)
+#endif
+{
+}
+
+MappedFile::
+~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::
+open(std::string filepath)
+{
+    close();
+
+#ifdef _WIN32
+    file_handle_ = CreateFileA(filepath.c_str(), GENERIC_READ,
+                               FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_handle_ == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle_, &file_size) || file_size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    size_ = (size_t)file_size.QuadPart;
+    mapping_handle_ = CreateFileMappingA(file_handle_, nullptr, PAGE_READONLY,
+                                         0, 0, nullptr);
+    if (mapping_handle_ == nullptr) {
+        close();
+        return false;
+    }
+    data_ = MapViewOfFile(mapping_handle_, FILE_MAP_READ, 0, 0, 0);
+    if (data_ == nullptr) {
+        close();
+        return false;
+    }
+#else
+    file_descriptor_ = ::open(filepath.c_str(), O_RDONLY);
+    if (file_descriptor_ < 0) {
+        return false;
+    }
+    struct stat file_status;
+    if (fstat(file_descriptor_, &file_status) != 0
+        || file_status.st_size == 0) {
+        close();
+        return false;
+    }
+    size_ = (size_t)file_status.st_size;
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE,
+                         file_descriptor_, 0);
+    if (mapping == MAP_FAILED) {
+        close();
+        return false;
+    }
+    data_ = mapping;
+#endif
+
+    return true;
+}
+
+void MappedFile::
+close()
+{
+#ifdef _WIN32
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_handle_ != nullptr) {
+        CloseHandle(mapping_handle_);
+        mapping_handle_ = nullptr;
+    }
+    if (file_handle_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_handle_);
+        file_handle_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (data_ != nullptr) {
+        munmap(const_cast<void*>(data_), size_);
+    }
+    if (file_descriptor_ >= 0) {
+        ::close(file_descriptor_);
+        file_descriptor_ = -1;
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+bool MappedFile::
+isOpen() const
+{
+    return data_ != nullptr;
+}
+
+const void* MappedFile::
+data() const
+{
+    return data_;
+}
+
+size_t MappedFile::
+size() const
+{
+    return size_;
+}
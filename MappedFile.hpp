@@ -0,0 +1,53 @@
+/*
+ @file      MappedFile.hpp
+ */
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+/**
+ Read-only view of a whole file mapped into the address space.
+ */
+class MappedFile
+{
+public:
+
+    MappedFile();
+
+    ~MappedFile();
+
+    /**
+     Maps the file at filepath, replacing any existing mapping.
+     @return  Boolean indicating success of the operation.
+     */
+    bool
+    open(std::string filepath);
+
+    void
+    close();
+
+    bool
+    isOpen() const;
+
+    const void*
+    data() const;
+
+    size_t
+    size() const;
+
+private:
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const void* data_;
+    size_t size_;
+#ifdef _WIN32
+    void* file_handle_;
+    void* mapping_handle_;
+#else
+    int file_descriptor_;
+#endif
+};
@@ -0,0 +1,942 @@
+#include "MeshOptimiser.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+
+namespace
+{
+
+const int kForsythCacheSize = 32;
+
+float
+forsythVertexScore(int cache_position,
+                   unsigned int remaining_triangles)
+{
+    if (remaining_triangles == 0) {
+        return -1.f;
+    }
+    float score = 0.f;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            // the last triangle's vertices get a fixed score so that
+            // strips are not favoured over fans
+            score = 0.75f;
+        } else {
+            const float scaler = 1.f / (kForsythCacheSize - 3);
+            score = powf(1.f - (cache_position - 3) * scaler, 1.5f);
+        }
+    }
+    // boost vertices with few triangles left to clear them out early
+    score += 2.f * powf((float)remaining_triangles, -0.5f);
+    return score;
+}
+
+struct Cluster
+{
+    unsigned int first_triangle;
+    unsigned int triangle_count;
+    float sort_key;
+};
+
+bool
+clusterDrawsEarlier(const Cluster& a,
+                    const Cluster& b)
+{
+    return a.sort_key > b.sort_key;
+}
+
+glm::vec3
+elementCentroid(const std::vector<MyScene::Vertex>& vertex_array,
+                const std::vector<unsigned int>& element_array)
+{
+    glm::vec3 centroid(0.f);
+    for (const auto element : element_array) {
+        centroid += vertex_array[element].position;
+    }
+    return centroid / (float)element_array.size();
+}
+
+/**
+ How far a run of triangles faces away from the middle of the mesh, as
+ the offset of its area weighted centroid along its mean normal. Higher
+ keys are likelier to occlude the rest of the mesh.
+ */
+float
+overdrawSortKey(const std::vector<MyScene::Vertex>& vertex_array,
+                const std::vector<unsigned int>& element_array,
+                unsigned int first_triangle,
+                unsigned int triangle_count,
+                const glm::vec3& mesh_centroid)
+{
+    glm::vec3 centroid(0.f);
+    glm::vec3 area_normal(0.f);
+    float area = 0.f;
+    for (unsigned int t=first_triangle; t<first_triangle+triangle_count; ++t) {
+        const glm::vec3& p0 = vertex_array[element_array[t*3]].position;
+        const glm::vec3& p1 = vertex_array[element_array[t*3+1]].position;
+        const glm::vec3& p2 = vertex_array[element_array[t*3+2]].position;
+        const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        const float a = glm::length(n);
+        centroid += (p0 + p1 + p2) * (a / 3.f);
+        area_normal += n;
+        area += a;
+    }
+    if (area <= 0.f) {
+        return 0.f;
+    }
+    centroid /= area;
+    const float normal_length = glm::length(area_normal);
+    if (normal_length <= 0.f) {
+        return 0.f;
+    }
+    return glm::dot(centroid - mesh_centroid, area_normal / normal_length);
+}
+
+// The combined attribute tuple of a vertex, either as raw float bits or
+// as grid cells when welding with a tolerance.
+struct WeldKey
+{
+    int64_t component[8];
+};
+
+struct WeldKeyHash
+{
+    size_t operator()(const WeldKey& key) const
+    {
+        const unsigned char* bytes = (const unsigned char*)key.component;
+        uint32_t h = 2166136261u;
+        for (size_t i=0; i<sizeof(key.component); ++i) {
+            h ^= bytes[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+};
+
+struct WeldKeyEqual
+{
+    bool operator()(const WeldKey& a, const WeldKey& b) const
+    {
+        return memcmp(a.component, b.component, sizeof(a.component)) == 0;
+    }
+};
+
+WeldKey
+weldKey(const MyScene::Vertex& vertex,
+        float epsilon)
+{
+    const float values[8] = { vertex.position.x, vertex.position.y,
+                              vertex.position.z, vertex.normal.x,
+                              vertex.normal.y, vertex.normal.z,
+                              vertex.texcoord.x, vertex.texcoord.y };
+    WeldKey key;
+    for (int i=0; i<8; ++i) {
+        if (epsilon > 0.f) {
+            key.component[i] = (int64_t)floor(values[i] / (double)epsilon
+                                              + 0.5);
+        } else {
+            // adding zero folds -0 into +0 so they weld together
+            const float value = values[i] + 0.f;
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            key.component[i] = bits;
+        }
+    }
+    return key;
+}
+
+// Symmetric 4x4 error quadric of Garland and Heckbert, upper triangle
+struct Quadric
+{
+    double a[10];
+
+    Quadric()
+    {
+        for (int i=0; i<10; ++i) {
+            a[i] = 0.0;
+        }
+    }
+
+    Quadric&
+    operator+=(const Quadric& q)
+    {
+        for (int i=0; i<10; ++i) {
+            a[i] += q.a[i];
+        }
+        return *this;
+    }
+
+    double
+    error(const glm::vec3& p) const
+    {
+        const double x = p.x, y = p.y, z = p.z;
+        const double e = a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+                       + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+                       + a[7]*z*z + 2*a[8]*z
+                       + a[9];
+        return e > 0.0 ? e : 0.0;
+    }
+};
+
+Quadric
+planeQuadric(const glm::vec3& p0,
+             const glm::vec3& p1,
+             const glm::vec3& p2)
+{
+    Quadric q;
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    const float length = glm::length(n);
+    if (length <= 0.f) {
+        return q;
+    }
+    n /= length;
+    const double a = n.x, b = n.y, c = n.z, d = -glm::dot(n, p0);
+    q.a[0] = a*a; q.a[1] = a*b; q.a[2] = a*c; q.a[3] = a*d;
+    q.a[4] = b*b; q.a[5] = b*c; q.a[6] = b*d;
+    q.a[7] = c*c; q.a[8] = c*d;
+    q.a[9] = d*d;
+    return q;
+}
+
+struct Collapse
+{
+    unsigned int from;
+    unsigned int to;
+    double cost;
+};
+
+bool
+collapseIsCheaper(const Collapse& a,
+                  const Collapse& b)
+{
+    return a.cost < b.cost;
+}
+
+// Cosine of the largest angle between a triangle and its cluster's seed
+const float kClusterNormalCos = 0.7f;
+
+void
+computeClusterBounds(const std::vector<MyScene::Vertex>& vertex_array,
+                     const std::vector<unsigned int>& element_array,
+                     MyScene::Cluster& cluster)
+{
+    const unsigned int end = cluster.first_element + cluster.element_count;
+    glm::vec3 bounds_min = vertex_array[element_array[cluster.first_element]].position;
+    glm::vec3 bounds_max = bounds_min;
+    glm::vec3 normal_sum(0.f);
+    for (unsigned int i=cluster.first_element; i<end; i+=3) {
+        const glm::vec3& p0 = vertex_array[element_array[i]].position;
+        const glm::vec3& p1 = vertex_array[element_array[i+1]].position;
+        const glm::vec3& p2 = vertex_array[element_array[i+2]].position;
+        bounds_min = glm::min(bounds_min, glm::min(p0, glm::min(p1, p2)));
+        bounds_max = glm::max(bounds_max, glm::max(p0, glm::max(p1, p2)));
+        const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        const float length = glm::length(n);
+        if (length > 0.f) {
+            normal_sum += n / length;
+        }
+    }
+
+    cluster.centre = (bounds_min + bounds_max) * 0.5f;
+    cluster.radius = 0.f;
+    for (unsigned int i=cluster.first_element; i<end; ++i) {
+        cluster.radius = std::max(cluster.radius,
+            glm::distance(cluster.centre,
+                          vertex_array[element_array[i]].position));
+    }
+
+    cluster.cone_axis = glm::vec3(0.f, 0.f, 1.f);
+    cluster.cone_cutoff = 1.f;
+    const float sum_length = glm::length(normal_sum);
+    if (sum_length <= 0.f) {
+        return;
+    }
+    cluster.cone_axis = normal_sum / sum_length;
+    float min_dot = 1.f;
+    for (unsigned int i=cluster.first_element; i<end; i+=3) {
+        const glm::vec3& p0 = vertex_array[element_array[i]].position;
+        const glm::vec3& p1 = vertex_array[element_array[i+1]].position;
+        const glm::vec3& p2 = vertex_array[element_array[i+2]].position;
+        const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        const float length = glm::length(n);
+        if (length > 0.f) {
+            min_dot = std::min(min_dot, glm::dot(n / length, cluster.cone_axis));
+        }
+    }
+    // normals spread over a hemisphere or more can face any direction
+    if (min_dot > 0.f) {
+        cluster.cone_cutoff = sqrtf(1.f - min_dot * min_dot);
+    }
+}
+
+} // end anonymous namespace
+
+VertexCacheStatistics
+analyseVertexCache(const std::vector<unsigned int>& element_array,
+                   unsigned int vertex_count,
+                   unsigned int cache_size)
+{
+    VertexCacheStatistics stats;
+    const size_t triangle_count = element_array.size() / 3;
+    if (triangle_count == 0) {
+        return stats;
+    }
+
+    // each vertex remembers the miss count at which it entered the FIFO,
+    // so it is still resident while fewer than cache_size misses followed
+    std::vector<unsigned int> entry_time(vertex_count, 0);
+    std::vector<bool> referenced(vertex_count, false);
+    unsigned int misses = 0;
+    unsigned int referenced_count = 0;
+    for (size_t i=0; i<triangle_count*3; ++i) {
+        const unsigned int v = element_array[i];
+        if (!referenced[v]) {
+            referenced[v] = true;
+            ++referenced_count;
+        }
+        if (entry_time[v] == 0 || misses - entry_time[v] + 1 > cache_size) {
+            ++misses;
+            entry_time[v] = misses;
+        }
+    }
+
+    stats.acmr = misses / (float)triangle_count;
+    stats.atvr = misses / (float)referenced_count;
+    return stats;
+}
+
+void
+weldVertices(std::vector<MyScene::Vertex>& vertex_array,
+             std::vector<unsigned int>& element_array,
+             float epsilon)
+{
+    std::unordered_map<WeldKey, unsigned int, WeldKeyHash, WeldKeyEqual>
+        first_vertex(vertex_array.size() * 2);
+    std::vector<unsigned int> remap(vertex_array.size());
+    std::vector<MyScene::Vertex> output;
+    output.reserve(vertex_array.size());
+    for (size_t i=0; i<vertex_array.size(); ++i) {
+        const WeldKey key = weldKey(vertex_array[i], epsilon);
+        auto found = first_vertex.find(key);
+        if (found == first_vertex.end()) {
+            found = first_vertex.insert(std::make_pair(key,
+                                        (unsigned int)output.size())).first;
+            output.push_back(vertex_array[i]);
+        }
+        remap[i] = found->second;
+    }
+    for (auto& element : element_array) {
+        element = remap[element];
+    }
+    vertex_array.swap(output);
+}
+
+void
+optimiseVertexCache(std::vector<unsigned int>& element_array,
+                    unsigned int vertex_count)
+{
+    const unsigned int triangle_count = element_array.size() / 3;
+    if (triangle_count == 0) {
+        return;
+    }
+
+    // build vertex to triangle adjacency in compressed rows
+    std::vector<unsigned int> remaining(vertex_count, 0);
+    for (unsigned int i=0; i<triangle_count*3; ++i) {
+        remaining[element_array[i]]++;
+    }
+    std::vector<unsigned int> adjacency_offset(vertex_count + 1, 0);
+    for (unsigned int v=0; v<vertex_count; ++v) {
+        adjacency_offset[v+1] = adjacency_offset[v] + remaining[v];
+    }
+    std::vector<unsigned int> adjacency(triangle_count * 3);
+    {
+        std::vector<unsigned int> fill(adjacency_offset.begin(),
+                                       adjacency_offset.end() - 1);
+        for (unsigned int t=0; t<triangle_count; ++t) {
+            for (int k=0; k<3; ++k) {
+                const unsigned int v = element_array[t*3+k];
+                adjacency[fill[v]++] = t;
+            }
+        }
+    }
+
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (unsigned int v=0; v<vertex_count; ++v) {
+        vertex_score[v] = forsythVertexScore(-1, remaining[v]);
+    }
+    std::vector<float> triangle_score(triangle_count);
+    std::vector<bool> emitted(triangle_count, false);
+    int best_triangle = -1;
+    float best_score = -1.f;
+    for (unsigned int t=0; t<triangle_count; ++t) {
+        triangle_score[t] = vertex_score[element_array[t*3]]
+                          + vertex_score[element_array[t*3+1]]
+                          + vertex_score[element_array[t*3+2]];
+        if (triangle_score[t] > best_score) {
+            best_score = triangle_score[t];
+            best_triangle = t;
+        }
+    }
+
+    std::vector<unsigned int> output;
+    output.reserve(triangle_count * 3);
+    unsigned int cache[kForsythCacheSize + 3];
+    int cache_count = 0;
+    unsigned int next_unemitted = 0;
+
+    while (output.size() < triangle_count * 3) {
+        if (best_triangle < 0) {
+            // nothing in the cache has triangles left; restart from the
+            // next triangle in input order
+            while (emitted[next_unemitted]) {
+                ++next_unemitted;
+            }
+            best_triangle = next_unemitted;
+        }
+
+        const unsigned int t = best_triangle;
+        emitted[t] = true;
+        const unsigned int tri[3] = { element_array[t*3],
+                                      element_array[t*3+1],
+                                      element_array[t*3+2] };
+        output.insert(output.end(), tri, tri + 3);
+
+        // remove the triangle from each vertex's list of live triangles
+        for (int k=0; k<3; ++k) {
+            const unsigned int v = tri[k];
+            const unsigned int begin = adjacency_offset[v];
+            const unsigned int end = begin + remaining[v];
+            for (unsigned int a=begin; a<end; ++a) {
+                if (adjacency[a] == t) {
+                    std::swap(adjacency[a], adjacency[end-1]);
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+
+        // push the triangle's vertices to the front of the LRU cache
+        unsigned int new_cache[kForsythCacheSize + 3];
+        int new_count = 0;
+        for (int k=0; k<3; ++k) {
+            new_cache[new_count++] = tri[k];
+        }
+        for (int c=0; c<cache_count; ++c) {
+            const unsigned int v = cache[c];
+            if (v != tri[0] && v != tri[1] && v != tri[2]) {
+                new_cache[new_count++] = v;
+            }
+        }
+        for (int c=kForsythCacheSize; c<new_count; ++c) {
+            cache_position[new_cache[c]] = -1;
+        }
+
+        // rescore every vertex that moved and the triangles they touch
+        best_triangle = -1;
+        best_score = -1.f;
+        for (int c=0; c<new_count; ++c) {
+            const unsigned int v = new_cache[c];
+            if (c < kForsythCacheSize) {
+                cache_position[v] = c;
+            }
+            vertex_score[v] = forsythVertexScore(cache_position[v],
+                                                 remaining[v]);
+        }
+        for (int c=0; c<new_count; ++c) {
+            const unsigned int v = new_cache[c];
+            const unsigned int begin = adjacency_offset[v];
+            const unsigned int end = begin + remaining[v];
+            for (unsigned int a=begin; a<end; ++a) {
+                const unsigned int adj = adjacency[a];
+                triangle_score[adj] = vertex_score[element_array[adj*3]]
+                                    + vertex_score[element_array[adj*3+1]]
+                                    + vertex_score[element_array[adj*3+2]];
+                if (triangle_score[adj] > best_score) {
+                    best_score = triangle_score[adj];
+                    best_triangle = adj;
+                }
+            }
+        }
+
+        cache_count = std::min(new_count, kForsythCacheSize);
+        std::copy(new_cache, new_cache + cache_count, cache);
+    }
+
+    element_array.swap(output);
+}
+
+void
+optimiseOverdraw(std::vector<unsigned int>& element_array,
+                 const std::vector<MyScene::Vertex>& vertex_array,
+                 float threshold)
+{
+    const unsigned int triangle_count = element_array.size() / 3;
+    if (triangle_count == 0) {
+        return;
+    }
+    const unsigned int vertex_count = vertex_array.size();
+    const float input_acmr = analyseVertexCache(element_array,
+                                                vertex_count).acmr;
+
+    // split at cache flushes, i.e. triangles whose three vertices all
+    // miss, so that reordering clusters keeps each one's cache locality
+    std::vector<Cluster> clusters;
+    {
+        const unsigned int cache_size = 16;
+        std::vector<unsigned int> entry_time(vertex_count, 0);
+        unsigned int misses = 0;
+        for (unsigned int t=0; t<triangle_count; ++t) {
+            int triangle_misses = 0;
+            for (int k=0; k<3; ++k) {
+                const unsigned int v = element_array[t*3+k];
+                if (entry_time[v] == 0
+                    || misses - entry_time[v] + 1 > cache_size) {
+                    ++misses;
+                    ++triangle_misses;
+                    entry_time[v] = misses;
+                }
+            }
+            if (t == 0 || triangle_misses == 3) {
+                Cluster cluster;
+                cluster.first_triangle = t;
+                cluster.triangle_count = 0;
+                cluster.sort_key = 0.f;
+                clusters.push_back(cluster);
+            }
+            clusters.back().triangle_count++;
+        }
+    }
+    if (clusters.size() < 2) {
+        return;
+    }
+
+    // clusters that face away from the middle of the mesh are likely to
+    // occlude the rest, so they are drawn first
+    const glm::vec3 mesh_centroid = elementCentroid(vertex_array,
+                                                    element_array);
+    for (auto& cluster : clusters) {
+        cluster.sort_key = overdrawSortKey(vertex_array, element_array,
+                                           cluster.first_triangle,
+                                           cluster.triangle_count,
+                                           mesh_centroid);
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), clusterDrawsEarlier);
+
+    std::vector<unsigned int> output;
+    output.reserve(triangle_count * 3);
+    for (const auto& cluster : clusters) {
+        output.insert(output.end(),
+                      element_array.begin() + cluster.first_triangle * 3,
+                      element_array.begin()
+                      + (cluster.first_triangle + cluster.triangle_count) * 3);
+    }
+
+    const float output_acmr = analyseVertexCache(output, vertex_count).acmr;
+    if (output_acmr <= input_acmr * threshold) {
+        element_array.swap(output);
+    }
+}
+
+void
+optimiseVertexFetch(std::vector<MyScene::Vertex>& vertex_array,
+                    std::vector<unsigned int>& element_array)
+{
+    const unsigned int unused = ~0u;
+    std::vector<unsigned int> remap(vertex_array.size(), unused);
+    std::vector<MyScene::Vertex> output;
+    output.reserve(vertex_array.size());
+    for (auto& element : element_array) {
+        if (remap[element] == unused) {
+            remap[element] = output.size();
+            output.push_back(vertex_array[element]);
+        }
+        element = remap[element];
+    }
+    vertex_array.swap(output);
+}
+
+float
+simplifyMesh(const std::vector<MyScene::Vertex>& vertex_array,
+             const std::vector<unsigned int>& element_array,
+             size_t target_element_count,
+             std::vector<unsigned int>& simplified_elements)
+{
+    const unsigned int vertex_count = vertex_array.size();
+    simplified_elements = element_array;
+
+    // vertices sharing a position are split along an attribute seam and
+    // are locked so the seam cannot tear open
+    std::vector<unsigned int> position_group(vertex_count);
+    std::vector<bool> locked(vertex_count, false);
+    {
+        std::unordered_map<WeldKey, unsigned int, WeldKeyHash, WeldKeyEqual>
+            first_vertex(vertex_count * 2);
+        std::vector<unsigned int> group_size(vertex_count, 0);
+        for (unsigned int v=0; v<vertex_count; ++v) {
+            MyScene::Vertex position_only = vertex_array[v];
+            position_only.normal = glm::vec3(0.f);
+            position_only.texcoord = glm::vec2(0.f);
+            const auto found = first_vertex.insert(std::make_pair(
+                weldKey(position_only, 0.f), v)).first;
+            position_group[v] = found->second;
+            group_size[found->second]++;
+        }
+        for (unsigned int v=0; v<vertex_count; ++v) {
+            locked[v] = group_size[position_group[v]] > 1;
+        }
+    }
+
+    // edges used by only one triangle lie on an open border
+    {
+        std::unordered_map<uint64_t, int> edge_use(element_array.size() * 2);
+        for (size_t t=0; t+2<element_array.size(); t+=3) {
+            for (int k=0; k<3; ++k) {
+                uint64_t a = position_group[element_array[t+k]];
+                uint64_t b = position_group[element_array[t+(k+1)%3]];
+                if (a > b) {
+                    std::swap(a, b);
+                }
+                edge_use[(a << 32) | b]++;
+            }
+        }
+        for (size_t t=0; t+2<element_array.size(); t+=3) {
+            for (int k=0; k<3; ++k) {
+                const unsigned int a = element_array[t+k];
+                const unsigned int b = element_array[t+(k+1)%3];
+                uint64_t ga = position_group[a];
+                uint64_t gb = position_group[b];
+                if (ga > gb) {
+                    std::swap(ga, gb);
+                }
+                if (edge_use[(ga << 32) | gb] == 1) {
+                    locked[a] = true;
+                    locked[b] = true;
+                }
+            }
+        }
+    }
+
+    std::vector<Quadric> quadrics(vertex_count);
+    for (size_t t=0; t+2<element_array.size(); t+=3) {
+        const unsigned int v[3] = { element_array[t],
+                                    element_array[t+1],
+                                    element_array[t+2] };
+        const Quadric q = planeQuadric(vertex_array[v[0]].position,
+                                       vertex_array[v[1]].position,
+                                       vertex_array[v[2]].position);
+        for (int k=0; k<3; ++k) {
+            quadrics[v[k]] += q;
+        }
+    }
+
+    double max_cost = 0.0;
+    std::vector<unsigned int> remap(vertex_count);
+    std::vector<bool> touched(vertex_count);
+    std::vector<unsigned int> adjacency_offset(vertex_count + 1);
+    std::vector<unsigned int> adjacency;
+    std::vector<Collapse> collapses;
+
+    // each pass collapses the cheapest independent edges, then rebuilds
+    while (simplified_elements.size() > target_element_count) {
+        const std::vector<unsigned int>& elements = simplified_elements;
+        const size_t triangle_count = elements.size() / 3;
+
+        collapses.clear();
+        for (size_t t=0; t<triangle_count; ++t) {
+            for (int k=0; k<3; ++k) {
+                const unsigned int a = elements[t*3+k];
+                const unsigned int b = elements[t*3+(k+1)%3];
+                for (int dir=0; dir<2; ++dir) {
+                    const unsigned int from = dir == 0 ? a : b;
+                    const unsigned int to = dir == 0 ? b : a;
+                    if (locked[from]) {
+                        continue;
+                    }
+                    Quadric q = quadrics[from];
+                    q += quadrics[to];
+                    Collapse collapse;
+                    collapse.from = from;
+                    collapse.to = to;
+                    collapse.cost = q.error(vertex_array[to].position);
+                    collapses.push_back(collapse);
+                }
+            }
+        }
+        if (collapses.empty()) {
+            break;
+        }
+        std::sort(collapses.begin(), collapses.end(), collapseIsCheaper);
+
+        std::fill(adjacency_offset.begin(), adjacency_offset.end(), 0);
+        for (size_t i=0; i<elements.size(); ++i) {
+            adjacency_offset[elements[i] + 1]++;
+        }
+        for (unsigned int v=0; v<vertex_count; ++v) {
+            adjacency_offset[v+1] += adjacency_offset[v];
+        }
+        adjacency.resize(elements.size());
+        {
+            std::vector<unsigned int> fill(adjacency_offset.begin(),
+                                           adjacency_offset.end() - 1);
+            for (size_t i=0; i<elements.size(); ++i) {
+                adjacency[fill[elements[i]]++] = i / 3;
+            }
+        }
+
+        for (unsigned int v=0; v<vertex_count; ++v) {
+            remap[v] = v;
+        }
+        std::fill(touched.begin(), touched.end(), false);
+
+        const size_t triangles_to_remove
+            = (elements.size() - target_element_count + 2) / 3;
+        size_t triangles_removed = 0;
+        size_t collapse_count = 0;
+        for (const auto& collapse : collapses) {
+            if (triangles_removed >= triangles_to_remove) {
+                break;
+            }
+            const unsigned int from = collapse.from;
+            const unsigned int to = collapse.to;
+            if (touched[from] || touched[to]) {
+                continue;
+            }
+
+            // reject the collapse if any surviving triangle would flip
+            bool flips = false;
+            size_t degenerate_count = 0;
+            for (unsigned int a=adjacency_offset[from];
+                 a<adjacency_offset[from+1] && !flips; ++a)
+            {
+                const size_t t = adjacency[a];
+                const unsigned int* tri = &elements[t*3];
+                if (tri[0] == to || tri[1] == to || tri[2] == to) {
+                    degenerate_count++;
+                    continue;
+                }
+                glm::vec3 p[3];
+                glm::vec3 q[3];
+                for (int k=0; k<3; ++k) {
+                    p[k] = vertex_array[tri[k]].position;
+                    q[k] = vertex_array[tri[k] == from ? to : tri[k]].position;
+                }
+                const glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+                const glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+                flips = glm::dot(n0, n1) <= 0.f;
+            }
+            if (flips || degenerate_count == 0) {
+                continue;
+            }
+
+            remap[from] = to;
+            quadrics[to] += quadrics[from];
+            max_cost = std::max(max_cost, collapse.cost);
+            triangles_removed += degenerate_count;
+            collapse_count++;
+
+            // neighbours of a collapsed vertex wait for the next pass, as
+            // their flip checks above assumed the old positions
+            for (unsigned int a=adjacency_offset[from];
+                 a<adjacency_offset[from+1]; ++a)
+            {
+                const unsigned int* tri = &elements[adjacency[a]*3];
+                for (int k=0; k<3; ++k) {
+                    touched[tri[k]] = true;
+                }
+            }
+        }
+        if (collapse_count == 0) {
+            break;
+        }
+
+        std::vector<unsigned int> rebuilt;
+        rebuilt.reserve(elements.size());
+        for (size_t t=0; t<triangle_count; ++t) {
+            const unsigned int a = remap[elements[t*3]];
+            const unsigned int b = remap[elements[t*3+1]];
+            const unsigned int c = remap[elements[t*3+2]];
+            if (a != b && b != c && c != a) {
+                rebuilt.push_back(a);
+                rebuilt.push_back(b);
+                rebuilt.push_back(c);
+            }
+        }
+        simplified_elements.swap(rebuilt);
+    }
+
+    return (float)sqrt(max_cost);
+}
+
+void
+buildClusters(const std::vector<MyScene::Vertex>& vertex_array,
+              std::vector<unsigned int>& element_array,
+              std::vector<MyScene::Cluster>& cluster_array,
+              unsigned int max_triangles)
+{
+    cluster_array.clear();
+    const unsigned int triangle_count = element_array.size() / 3;
+    const unsigned int vertex_count = vertex_array.size();
+    if (triangle_count == 0) {
+        return;
+    }
+
+    std::vector<glm::vec3> normals(triangle_count);
+    for (unsigned int t=0; t<triangle_count; ++t) {
+        const glm::vec3& p0 = vertex_array[element_array[t*3]].position;
+        const glm::vec3& p1 = vertex_array[element_array[t*3+1]].position;
+        const glm::vec3& p2 = vertex_array[element_array[t*3+2]].position;
+        const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        const float length = glm::length(n);
+        normals[t] = length > 0.f ? n / length : glm::vec3(0.f);
+    }
+
+    std::vector<unsigned int> adjacency_offset(vertex_count + 1, 0);
+    for (unsigned int i=0; i<triangle_count*3; ++i) {
+        adjacency_offset[element_array[i] + 1]++;
+    }
+    for (unsigned int v=0; v<vertex_count; ++v) {
+        adjacency_offset[v+1] += adjacency_offset[v];
+    }
+    std::vector<unsigned int> adjacency(triangle_count * 3);
+    {
+        std::vector<unsigned int> fill(adjacency_offset.begin(),
+                                       adjacency_offset.end() - 1);
+        for (unsigned int i=0; i<triangle_count*3; ++i) {
+            adjacency[fill[element_array[i]]++] = i / 3;
+        }
+    }
+
+    // grow each cluster outward from a seed through shared vertices,
+    // taking only triangles that face roughly the same way as the seed
+    std::vector<bool> assigned(triangle_count, false);
+    std::vector<unsigned int> output;
+    output.reserve(element_array.size());
+    std::vector<unsigned int> members;
+    for (unsigned int seed=0; seed<triangle_count; ++seed) {
+        if (assigned[seed]) {
+            continue;
+        }
+        members.clear();
+        members.push_back(seed);
+        assigned[seed] = true;
+        const glm::vec3 seed_normal = normals[seed];
+        for (size_t next=0;
+             next<members.size() && members.size()<max_triangles; ++next)
+        {
+            const unsigned int t = members[next];
+            for (int k=0; k<3 && members.size()<max_triangles; ++k) {
+                const unsigned int v = element_array[t*3+k];
+                for (unsigned int a=adjacency_offset[v];
+                     a<adjacency_offset[v+1] && members.size()<max_triangles;
+                     ++a)
+                {
+                    const unsigned int u = adjacency[a];
+                    // degenerate triangles have no normal and fit anywhere
+                    if (!assigned[u]
+                        && (glm::dot(normals[u], seed_normal) >= kClusterNormalCos
+                            || normals[u] == glm::vec3(0.f)))
+                    {
+                        assigned[u] = true;
+                        members.push_back(u);
+                    }
+                }
+            }
+        }
+
+        // keep the cache optimised order within the cluster
+        std::sort(members.begin(), members.end());
+        MyScene::Cluster cluster;
+        cluster.first_element = output.size();
+        cluster.element_count = members.size() * 3;
+        for (const auto t : members) {
+            output.insert(output.end(),
+                          element_array.begin() + t * 3,
+                          element_array.begin() + t * 3 + 3);
+        }
+        cluster_array.push_back(cluster);
+    }
+
+    element_array.swap(output);
+    for (auto& cluster : cluster_array) {
+        computeClusterBounds(vertex_array, element_array, cluster);
+    }
+}
+
+void
+optimiseClusters(const std::vector<MyScene::Vertex>& vertex_array,
+                 std::vector<unsigned int>& element_array,
+                 std::vector<MyScene::Cluster>& cluster_array)
+{
+    if (cluster_array.empty()) {
+        return;
+    }
+
+    // each cluster is cache optimised over its own vertices, renumbered
+    // from zero so the work is proportional to the cluster's size
+    std::vector<int> local_index(vertex_array.size(), -1);
+    std::vector<unsigned int> global_index;
+    std::vector<unsigned int> local_elements;
+    for (const auto& cluster : cluster_array) {
+        const unsigned int first = cluster.first_element;
+        const unsigned int end = first + cluster.element_count;
+        global_index.clear();
+        local_elements.clear();
+        for (unsigned int i=first; i<end; ++i) {
+            const unsigned int v = element_array[i];
+            if (local_index[v] < 0) {
+                local_index[v] = global_index.size();
+                global_index.push_back(v);
+            }
+            local_elements.push_back(local_index[v]);
+        }
+        optimiseVertexCache(local_elements, global_index.size());
+        for (unsigned int i=first; i<end; ++i) {
+            element_array[i] = global_index[local_elements[i - first]];
+        }
+        for (const auto v : global_index) {
+            local_index[v] = -1;
+        }
+    }
+
+    // then the clusters most likely to occlude the rest go first, as
+    // optimiseOverdraw orders its cache runs
+    const glm::vec3 mesh_centroid = elementCentroid(vertex_array,
+                                                    element_array);
+    std::vector<Cluster> order(cluster_array.size());
+    for (unsigned int c=0; c<cluster_array.size(); ++c) {
+        order[c].first_triangle = cluster_array[c].first_element / 3;
+        order[c].triangle_count = cluster_array[c].element_count / 3;
+        order[c].sort_key = overdrawSortKey(vertex_array, element_array,
+                                            order[c].first_triangle,
+                                            order[c].triangle_count,
+                                            mesh_centroid);
+    }
+    std::vector<unsigned int> sorted(cluster_array.size());
+    for (unsigned int c=0; c<sorted.size(); ++c) {
+        sorted[c] = c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [&](unsigned int a, unsigned int b) {
+                         return clusterDrawsEarlier(order[a], order[b]);
+                     });
+
+    std::vector<unsigned int> output;
+    output.reserve(element_array.size());
+    std::vector<MyScene::Cluster> output_clusters;
+    output_clusters.reserve(cluster_array.size());
+    for (const auto c : sorted) {
+        MyScene::Cluster cluster = cluster_array[c];
+        output.insert(output.end(),
+                      element_array.begin() + cluster.first_element,
+                      element_array.begin() + cluster.first_element
+                      + cluster.element_count);
+        cluster.first_element = output.size() - cluster.element_count;
+        output_clusters.push_back(cluster);
+    }
+    element_array.swap(output);
+    cluster_array.swap(output_clusters);
+}
@@ -0,0 +1,102 @@
+/*
+ @file      MeshOptimiser.hpp
+ */
+
+#pragma once
+
+#include "MyScene.hpp"
+#include <vector>
+
+/**
+ Post-transform vertex cache efficiency of an indexed triangle list.
+ */
+struct VertexCacheStatistics
+{
+    float acmr; // average cache misses per triangle
+    float atvr; // average transforms per referenced vertex
+
+    VertexCacheStatistics() : acmr(0.f), atvr(0.f) {}
+};
+
+/**
+ Simulates a FIFO post-transform cache over an element array.
+ @param cache_size  Number of vertices the simulated cache holds.
+ */
+VertexCacheStatistics
+analyseVertexCache(const std::vector<unsigned int>& element_array,
+                   unsigned int vertex_count,
+                   unsigned int cache_size = 16);
+
+/**
+ Merges vertices whose position, normal and texcoord all match and
+ rewrites the element array to share them.
+ @param epsilon  Zero to merge only bitwise equal vertices, otherwise the
+                 size of the grid each attribute is snapped to before
+                 comparison.
+ */
+void
+weldVertices(std::vector<MyScene::Vertex>& vertex_array,
+             std::vector<unsigned int>& element_array,
+             float epsilon = 0.f);
+
+/**
+ Reorders triangles to maximise post-transform vertex cache hits using
+ Tom Forsyth's linear-speed vertex cache optimisation.
+ */
+void
+optimiseVertexCache(std::vector<unsigned int>& element_array,
+                    unsigned int vertex_count);
+
+/**
+ Reorders clusters of a cache-optimised element array so outward facing
+ clusters are drawn first, reducing overdraw from most viewpoints. The
+ result is kept only if its ACMR is within threshold times the input's.
+ */
+void
+optimiseOverdraw(std::vector<unsigned int>& element_array,
+                 const std::vector<MyScene::Vertex>& vertex_array,
+                 float threshold = 1.05f);
+
+/**
+ Reorders vertices into the order the element array first uses them,
+ dropping any vertex that is never referenced.
+ */
+void
+optimiseVertexFetch(std::vector<MyScene::Vertex>& vertex_array,
+                    std::vector<unsigned int>& element_array);
+
+/**
+ Simplifies a triangle list with quadric error metric edge collapses that
+ only ever move a vertex onto a neighbour, so the result indexes the same
+ vertex array. Vertices on open borders or attribute seams never move.
+ @param target_element_count  Element count to stop at, if reachable.
+ @param simplified_elements   Receives the simplified element array.
+ @return  Approximate geometric error introduced, in mesh units.
+ */
+float
+simplifyMesh(const std::vector<MyScene::Vertex>& vertex_array,
+             const std::vector<unsigned int>& element_array,
+             size_t target_element_count,
+             std::vector<unsigned int>& simplified_elements);
+
+/**
+ Partitions a triangle list into clusters of spatially connected, similarly
+ facing triangles, reordering the element array so each cluster is one
+ contiguous range, and computes each cluster's bounding sphere and normal
+ cone for culling.
+ */
+void
+buildClusters(const std::vector<MyScene::Vertex>& vertex_array,
+              std::vector<unsigned int>& element_array,
+              std::vector<MyScene::Cluster>& cluster_array,
+              unsigned int max_triangles = 96);
+
+/**
+ Orders a clustered element array for drawing without disturbing the
+ clusters: triangles are cache optimised within each cluster, then the
+ clusters are reordered, outward facing first, to reduce overdraw.
+ */
+void
+optimiseClusters(const std::vector<MyScene::Vertex>& vertex_array,
+                 std::vector<unsigned int>& element_array,
+                 std::vector<MyScene::Cluster>& cluster_array);
@@ -2,18 +2,26 @@
 #include "MyView.hpp"
 #include "MyScene.hpp"
 #include "Window.hpp"
+#include "StartupProfile.hpp"
 #include <iostream>
 
 MyController::
-MyController() : camera_turn_mode_(false)
+MyController() : camera_turn_mode_(false),
+                 occlusion_culling_(false),
+                 depth_prepass_(false)
 {
     camera_move_key_[0] = false;
     camera_move_key_[1] = false;
     camera_move_key_[2] = false;
     camera_move_key_[3] = false;
-    scene_.reset(new MyScene());
+    {
+        ScopedPhaseTimer timer("scene_load");
+        scene_.reset(new MyScene());
+    }
 	view_.reset(new MyView());
     view_->setScene(scene_);
+    view_->setUseCompactVertices(true);
+    view_->setUploadBudget(4 << 20);
 }
 
 MyController::
@@ -99,6 +107,27 @@ windowControlKeyboardChanged(std::shared_ptr<tyga::Window> window,
     case 'S':
         camera_move_key_[3] = down;
         break;
+    case 'P':
+        if (down) {
+            printRenderStatistics();
+        }
+        break;
+    case 'O':
+        if (down) {
+            occlusion_culling_ = !occlusion_culling_;
+            view_->setUseOcclusionCulling(occlusion_culling_);
+            std::cout << "Occlusion culling "
+                      << (occlusion_culling_ ? "on" : "off") << std::endl;
+        }
+        break;
+    case 'Z':
+        if (down) {
+            depth_prepass_ = !depth_prepass_;
+            view_->setUseDepthPrepass(depth_prepass_);
+            std::cout << "Depth pre-pass "
+                      << (depth_prepass_ ? "on" : "off") << std::endl;
+        }
+        break;
     }
 
     const float key_speed = 100.f;
@@ -124,3 +153,35 @@ windowControlGamepadButtonChanged(std::shared_ptr<tyga::Window> window,
                                   bool down)
 {
 }
+
+void MyController::
+printRenderStatistics() const
+{
+    const MyView::RenderStatistics stats = view_->renderStatistics();
+    std::cout << "Models: " << stats.model_count
+              << " drawn, " << stats.culled_count << " culled"
+              << ", draws: " << stats.draw_count
+              << " in " << stats.submission_count << " submissions"
+              << ", state changes: " << stats.unsorted_state_changes
+              << " in scene order, " << stats.sorted_state_changes
+              << " sorted" << std::endl;
+    if (occlusion_culling_) {
+        std::cout << "Occlusion: " << stats.occluded_count << " hidden, "
+                  << stats.occlusion_query_count << " queries, "
+                  << stats.occlusion_query_latency
+                  << " frames mean query latency" << std::endl;
+    }
+    std::cout << "GPU time: " << stats.forward_gpu_time_ms
+              << " ms without depth pre-pass, "
+              << stats.depth_prepass_gpu_time_ms << " ms with" << std::endl;
+
+    // GL calls made and dropped as redundant since the last report
+    for (int i = 0; i < TGL_STATE_CALL_MAX; ++i) {
+        const TGLSTATECALL call = (TGLSTATECALL)i;
+        GLuint issued = 0, elided = 0;
+        tglGetStateCacheCounts(call, &issued, &elided);
+        std::cout << "  " << tglStateCallName(call) << ": " << issued
+                  << " issued, " << elided << " elided" << std::endl;
+    }
+    tglResetStateCacheCounts();
+}
@@ -54,9 +54,14 @@ private:
                                       int button_index,
                                       bool down) override;
 
+    void
+    printRenderStatistics() const;
+
 	std::shared_ptr<MyView> view_;
     std::shared_ptr<MyScene> scene_;
 
     bool camera_turn_mode_;
     bool camera_move_key_[4];
+    bool occlusion_culling_;
+    bool depth_prepass_;
 };
@@ -1,13 +1,24 @@
 #include "MyScene.hpp"
 #include "FirstPersonMovement.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+#include "MeshOptimiser.hpp"
+#include "StartupProfile.hpp"
 #include <tcf/SimpleScene.hpp>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <cfloat>
 
 MyScene::
-MyScene()
+MyScene(LoadOptions options) : options_(options)
 {
     start_time_ = std::chrono::system_clock::now();
     time_seconds_ = 0.f;
+    model_hierarchy_stale_ = false;
+    model_revision_ = 0;
 
     if (!readFile("sponza.tcf")) {
         std::cerr << "Failed to read sponza.tcf data file" << std::endl;
@@ -15,6 +26,8 @@ MyScene()
 
     camera_.reset(new FirstPersonMovement());
     camera_->init(glm::vec3(80, 50, 0), 1.5f, 0.5f);
+
+    updateFrameState();
 }
 
 MyScene::
@@ -39,78 +52,714 @@ setCameraRotationSpeed(float horizontal,
     camera_rotation_speed_.y = vertical;
 }
 
+namespace
+{
+
+// Bump whenever the cache layout or the processing applied to the meshes
+// before caching changes, so stale caches are rebuilt rather than misread.
+const uint32_t kCacheVersion = 6;
+const char kCacheMagic[4] = { 'S', 'M', 'S', 'C' };
+
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t vertex_size;
+    uint32_t mesh_count;
+    uint32_t model_count;
+    uint32_t processing_key;
+};
+
+struct CacheMesh
+{
+    uint32_t vertex_count;
+    uint32_t element_count;
+    uint32_t instance_count;
+    uint32_t lod_count;
+    uint32_t cluster_count;
+};
+
+struct CacheLod
+{
+    uint32_t first_element;
+    uint32_t element_count;
+    float error;
+};
+
+struct CacheCluster
+{
+    uint32_t first_element;
+    uint32_t element_count;
+    float centre[3];
+    float radius;
+    float cone_axis[3];
+    float cone_cutoff;
+};
+
+const int kMaxLodCount = 4;
+const size_t kMinLodElementCount = 3 * 64;
+
+struct CacheModel
+{
+    uint32_t mesh_index;
+    float xform[12];
+};
+
+// Whether [first, first + count) lies within an array of size elements,
+// without overflowing.
+bool
+rangeInside(unsigned int first,
+            unsigned int count,
+            size_t size)
+{
+    return first <= size && count <= size - first;
+}
+
+// Whether every index and range of a mesh read from the cache lies within
+// the arrays it refers to, so a corrupt or stale cache is rejected rather
+// than read out of bounds later.
+bool
+meshIsConsistent(const MyScene::Mesh& mesh,
+                 size_t model_count)
+{
+    if (mesh.element_array.size() % 3 != 0 || mesh.lod_array.empty()) {
+        return false;
+    }
+    for (const auto element : mesh.element_array) {
+        if (element >= mesh.vertex_array.size()) {
+            return false;
+        }
+    }
+    for (const auto model_index : mesh.instance_array) {
+        if (model_index >= model_count) {
+            return false;
+        }
+    }
+    for (const auto& lod : mesh.lod_array) {
+        if (!rangeInside(lod.first_element, lod.element_count,
+                         mesh.element_array.size())) {
+            return false;
+        }
+    }
+    for (const auto& cluster : mesh.cluster_array) {
+        if (!rangeInside(cluster.first_element, cluster.element_count,
+                         mesh.element_array.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 64-bit FNV-1a over the bytes of a file.
+bool
+hashFile(std::string filepath,
+         uint64_t* hash)
+{
+    MappedFile file;
+    if (!file.open(filepath)) {
+        return false;
+    }
+    const unsigned char* bytes = (const unsigned char*)file.data();
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i=0; i<file.size(); ++i) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    *hash = h;
+    return true;
+}
+
+} // end anonymous namespace
+
 bool MyScene::
 readFile(std::string filepath)
 {
+    uint64_t source_hash = 0;
+    {
+        ScopedPhaseTimer timer("scene_hash");
+        if (!hashFile(filepath, &source_hash)) {
+            return false;
+        }
+    }
+
+    const std::string cache_filepath = filepath + ".cache";
+    bool cache_read = false;
+    {
+        ScopedPhaseTimer timer("cache_read");
+        cache_read = readCacheFile(cache_filepath, source_hash);
+    }
+    if (!cache_read) {
+        if (!readSceneFile(filepath)) {
+            return false;
+        }
+        {
+            ScopedPhaseTimer timer("mesh_processing");
+            processMeshes();
+        }
+        ScopedPhaseTimer timer("cache_write");
+        if (!writeCacheFile(cache_filepath, source_hash)) {
+            std::cerr << "Failed to write " << cache_filepath << std::endl;
+        }
+    }
+
+    {
+        ScopedPhaseTimer timer("bounds");
+        computeBounds();
+    }
+    {
+        ScopedPhaseTimer timer("hierarchy");
+        updateHierarchy(true);
+    }
+
+    // materials live in a sidecar file so scenes can ship without a rebuild
+    const std::string material_filepath
+        = filepath.substr(0, filepath.rfind('.')) + ".materials";
+    ScopedPhaseTimer timer("material_read");
+    if (!readMaterialFile(material_filepath)) {
+        std::cerr << "Failed to read " << material_filepath
+                  << ", using a default material" << std::endl;
+        Material default_material;
+        default_material.colour = glm::vec3(0.8f, 0.8f, 0.8f);
+        default_material.shininess_texture = -1;
+        materials_.assign(1, default_material);
+        textures_.clear();
+        for (auto& model : models_) {
+            model.material_index = 0;
+        }
+    }
+
+    return true;
+}
+
+bool MyScene::
+readSceneFile(std::string filepath)
+{
+    ScopedPhaseTimer parse_timer("tcf_parse");
     tcf::Error error;
     tcf::SimpleScene tcf_scene = tcf::simpleSceneFromFile(filepath, &error);
+    parse_timer.stop();
     if (error != tcf::kNoError) {
         return false;
     }
 
+    ScopedPhaseTimer timer("mesh_conversion");
+
+    const int mesh_count = tcf_scene.meshArray.size();
+
+    // Model indices are handed out serially up front so they do not depend
+    // on the order in which the per-mesh tasks below happen to finish.
+    std::vector<unsigned int> first_model_index(mesh_count);
+    unsigned int model_count = 0;
+    for (int i=0; i<mesh_count; ++i) {
+        first_model_index[i] = model_count;
+        model_count += tcf_scene.meshArray[i].instanceArray.size();
+    }
+
     meshes_.clear();
     models_.clear();
+    meshes_.resize(mesh_count);
+    models_.resize(model_count);
 
-    meshes_.reserve(tcf_scene.meshArray.size());
-    for (const auto& mesh : tcf_scene.meshArray) {
-        Mesh new_mesh;
+    // Each task builds its mesh in place in meshes_ and writes only its own
+    // range of models_, so no locking or copying is needed.
+    ThreadPool pool;
+    pool.parallelFor(mesh_count, [&](int mesh_index) {
+        const auto& mesh = tcf_scene.meshArray[mesh_index];
+        Mesh& new_mesh = meshes_[mesh_index];
         new_mesh.instance_array.reserve(mesh.instanceArray.size());
-        models_.reserve(models_.size() + mesh.instanceArray.size());
+        unsigned int model_index = first_model_index[mesh_index];
         for (const auto& model : mesh.instanceArray) {
-            Model new_model;
-            new_model.mesh_index = meshes_.size();
-			new_model.material_index = 0;
+            Model& new_model = models_[model_index];
+            new_model.mesh_index = mesh_index;
+            new_model.material_index = 0;
             new_model.xform = glm::mat4x3(model.m00, model.m01, model.m02,
                                           model.m10, model.m11, model.m12,
                                           model.m20, model.m21, model.m22,
                                           model.m30, model.m31, model.m32);
-            new_mesh.instance_array.push_back(models_.size());
-            models_.push_back(new_model);
+            new_mesh.instance_array.push_back(model_index++);
         }
         new_mesh.element_array.assign((unsigned int*)&mesh.indexArray.front(),
                                       (unsigned int*)&mesh.indexArray.back()+1);
-        new_mesh.normal_array.assign((glm::vec3*)&mesh.normalArray.front(),
-                                     (glm::vec3*)&mesh.normalArray.back()+1);
-        new_mesh.position_array.assign((glm::vec3*)&mesh.vertexArray.front(),
-                                       (glm::vec3*)&mesh.vertexArray.back()+1);
-        new_mesh.tangent_array.assign((glm::vec3*)&mesh.tangentArray.front(),
-                                      (glm::vec3*)&mesh.tangentArray.back()+1);
-        new_mesh.texcoord_array.assign((glm::vec2*)&mesh.texcoordArray.front(),
-                                      (glm::vec2*)&mesh.texcoordArray.back()+1);
-        meshes_.push_back(new_mesh);
-    }
-
-    // hardcode some material data ... not good practice!
-    int redShapes[] = { 35, 36, 37, 38, 39, 40, 41, 42, 69, 70, 71, 72, 73, 74,
-                        75, 76, 77, 78, 79 };
-    int greenShapes[] = { 8, 19, 31, 33, 54, 57, 67, 68, 66, 80 };
-    int yellowShapes[] = { 4, 5, 6, 7, 23, 24, 25, 26, 27, 28, 29, 30, 44, 45,
-                           46, 47, 48, 49, 50, 51, 52, 53 };
-    int *shapes[3] = { redShapes, greenShapes, yellowShapes };
-    int numberOfShapes[] = { sizeof(redShapes) / sizeof(int),
-                             sizeof(greenShapes) / sizeof(int),
-                             sizeof(yellowShapes) / sizeof(int) };
-    glm::vec3 colours[3] = { glm::vec3(1.f, 0.33f, 0.f),
-                             glm::vec3(0.2f, 0.8f, 0.2f),
-                             glm::vec3(0.8f, 0.8f, 0.2f) };
-    std::string shininess[3] = { "shin1.png", "shin2.png", "shin3.png" };
-    Material new_material;
-    new_material.colour = glm::vec3(0.8f, 0.8f, 0.8f);
-    materials_.push_back(new_material);
-    for (int j=0; j<3; ++j) {
-        Material new_material;
-        new_material.colour = colours[j];
-        new_material.shininess_map = shininess[j];
-        materials_.push_back(new_material);
-        for (int i=0; i<numberOfShapes[j]; ++i) {
-            int index = shapes[j][i];
-            models_[index].material_index = j+1;
+        Lod full_detail;
+        full_detail.first_element = 0;
+        full_detail.element_count = new_mesh.element_array.size();
+        full_detail.error = 0.f;
+        new_mesh.lod_array.assign(1, full_detail);
+        const glm::vec3* positions = (const glm::vec3*)&mesh.vertexArray.front();
+        const glm::vec3* normals = (const glm::vec3*)&mesh.normalArray.front();
+        const glm::vec2* texcoords = (const glm::vec2*)&mesh.texcoordArray.front();
+        new_mesh.vertex_array.resize(mesh.vertexArray.size());
+        for (size_t i=0; i<new_mesh.vertex_array.size(); ++i) {
+            new_mesh.vertex_array[i].position = positions[i];
+            new_mesh.vertex_array[i].normal = normals[i];
+            new_mesh.vertex_array[i].texcoord = texcoords[i];
         }
+    });
+
+    return true;
+}
+
+bool MyScene::
+readMaterialFile(std::string filepath)
+{
+    std::ifstream file(filepath);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    materials_.clear();
+    textures_.clear();
+    std::vector<std::string> material_names;
+
+    // Each line is either
+    //   material <name> <red> <green> <blue> [shininess map]
+    //   models <material name> <model index> ...
+    // and the first material is applied to any model not listed.
+    std::string line;
+    for (int line_number=1; std::getline(file, line); ++line_number) {
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+        if (keyword == "material") {
+            std::string name;
+            Material material;
+            if (!(words >> name >> material.colour.x
+                        >> material.colour.y >> material.colour.z)) {
+                std::cerr << filepath << ":" << line_number
+                          << ": malformed material" << std::endl;
+                return false;
+            }
+            material.shininess_texture = -1;
+            if (words >> material.shininess_map) {
+                auto texture = std::find(textures_.begin(), textures_.end(),
+                                         material.shininess_map);
+                material.shininess_texture = texture - textures_.begin();
+                if (texture == textures_.end()) {
+                    textures_.push_back(material.shininess_map);
+                }
+            }
+            material_names.push_back(name);
+            materials_.push_back(material);
+        } else if (keyword == "models") {
+            std::string name;
+            words >> name;
+            auto material = std::find(material_names.begin(),
+                                      material_names.end(), name);
+            if (material == material_names.end()) {
+                std::cerr << filepath << ":" << line_number
+                          << ": unknown material " << name << std::endl;
+                return false;
+            }
+            unsigned int model_index;
+            while (words >> model_index) {
+                if (model_index < models_.size()) {
+                    models_[model_index].material_index
+                        = material - material_names.begin();
+                }
+            }
+        } else {
+            std::cerr << filepath << ":" << line_number
+                      << ": unknown keyword " << keyword << std::endl;
+            return false;
+        }
+    }
+
+    return !materials_.empty();
+}
+
+bool MyScene::
+readCacheFile(std::string filepath,
+              uint64_t source_hash)
+{
+    MappedFile file;
+    if (!file.open(filepath) || file.size() < sizeof(CacheHeader)) {
+        return false;
+    }
+    const char* bytes = (const char*)file.data();
+    const char* const bytes_end = bytes + file.size();
+
+    const CacheHeader* header = (const CacheHeader*)bytes;
+    if (memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0
+        || header->version != kCacheVersion
+        || header->source_hash != source_hash
+        || header->vertex_size != sizeof(Vertex)
+        || header->processing_key != processingKey()) {
+        return false;
+    }
+    bytes += sizeof(CacheHeader);
+
+    const size_t tables_size = header->mesh_count * sizeof(CacheMesh)
+                             + header->model_count * sizeof(CacheModel);
+    if ((size_t)(bytes_end - bytes) < tables_size) {
+        return false;
+    }
+    const CacheMesh* cache_meshes = (const CacheMesh*)bytes;
+    bytes += header->mesh_count * sizeof(CacheMesh);
+    const CacheModel* cache_models = (const CacheModel*)bytes;
+    bytes += header->model_count * sizeof(CacheModel);
+
+    size_t payload_size = 0;
+    for (uint32_t i=0; i<header->mesh_count; ++i) {
+        payload_size += cache_meshes[i].vertex_count * sizeof(Vertex)
+                      + cache_meshes[i].element_count * sizeof(unsigned int)
+                      + cache_meshes[i].instance_count * sizeof(unsigned int)
+                      + cache_meshes[i].lod_count * sizeof(CacheLod)
+                      + cache_meshes[i].cluster_count * sizeof(CacheCluster);
+    }
+    if ((size_t)(bytes_end - bytes) != payload_size) {
+        return false;
+    }
+
+    meshes_.clear();
+    models_.clear();
+
+    meshes_.resize(header->mesh_count);
+    for (uint32_t i=0; i<header->mesh_count; ++i) {
+        Mesh& mesh = meshes_[i];
+        const Vertex* vertices = (const Vertex*)bytes;
+        mesh.vertex_array.assign(vertices,
+                                 vertices + cache_meshes[i].vertex_count);
+        bytes += cache_meshes[i].vertex_count * sizeof(Vertex);
+        const unsigned int* elements = (const unsigned int*)bytes;
+        mesh.element_array.assign(elements,
+                                  elements + cache_meshes[i].element_count);
+        bytes += cache_meshes[i].element_count * sizeof(unsigned int);
+        const unsigned int* instances = (const unsigned int*)bytes;
+        mesh.instance_array.assign(instances,
+                                   instances + cache_meshes[i].instance_count);
+        bytes += cache_meshes[i].instance_count * sizeof(unsigned int);
+        const CacheLod* lods = (const CacheLod*)bytes;
+        mesh.lod_array.resize(cache_meshes[i].lod_count);
+        for (uint32_t j=0; j<cache_meshes[i].lod_count; ++j) {
+            mesh.lod_array[j].first_element = lods[j].first_element;
+            mesh.lod_array[j].element_count = lods[j].element_count;
+            mesh.lod_array[j].error = lods[j].error;
+        }
+        bytes += cache_meshes[i].lod_count * sizeof(CacheLod);
+        const CacheCluster* clusters = (const CacheCluster*)bytes;
+        mesh.cluster_array.resize(cache_meshes[i].cluster_count);
+        for (uint32_t j=0; j<cache_meshes[i].cluster_count; ++j) {
+            Cluster& cluster = mesh.cluster_array[j];
+            cluster.first_element = clusters[j].first_element;
+            cluster.element_count = clusters[j].element_count;
+            cluster.centre = glm::vec3(clusters[j].centre[0],
+                                       clusters[j].centre[1],
+                                       clusters[j].centre[2]);
+            cluster.radius = clusters[j].radius;
+            cluster.cone_axis = glm::vec3(clusters[j].cone_axis[0],
+                                          clusters[j].cone_axis[1],
+                                          clusters[j].cone_axis[2]);
+            cluster.cone_cutoff = clusters[j].cone_cutoff;
+        }
+        bytes += cache_meshes[i].cluster_count * sizeof(CacheCluster);
+
+        if (!meshIsConsistent(mesh, header->model_count)) {
+            meshes_.clear();
+            return false;
+        }
+    }
+
+    models_.resize(header->model_count);
+    for (uint32_t i=0; i<header->model_count; ++i) {
+        if (cache_models[i].mesh_index >= header->mesh_count) {
+            meshes_.clear();
+            models_.clear();
+            return false;
+        }
+        const float* m = cache_models[i].xform;
+        models_[i].mesh_index = cache_models[i].mesh_index;
+        models_[i].material_index = 0;
+        models_[i].xform = glm::mat4x3(m[0], m[1], m[2],
+                                       m[3], m[4], m[5],
+                                       m[6], m[7], m[8],
+                                       m[9], m[10], m[11]);
     }
 
     return true;
 }
 
+bool MyScene::
+writeCacheFile(std::string filepath,
+               uint64_t source_hash) const
+{
+    std::ofstream file(filepath, std::ofstream::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.version = kCacheVersion;
+    header.source_hash = source_hash;
+    header.vertex_size = sizeof(Vertex);
+    header.mesh_count = meshes_.size();
+    header.model_count = models_.size();
+    header.processing_key = processingKey();
+    file.write((const char*)&header, sizeof(header));
+
+    for (const auto& mesh : meshes_) {
+        CacheMesh cache_mesh;
+        cache_mesh.vertex_count = mesh.vertex_array.size();
+        cache_mesh.element_count = mesh.element_array.size();
+        cache_mesh.instance_count = mesh.instance_array.size();
+        cache_mesh.lod_count = mesh.lod_array.size();
+        cache_mesh.cluster_count = mesh.cluster_array.size();
+        file.write((const char*)&cache_mesh, sizeof(cache_mesh));
+    }
+
+    for (const auto& model : models_) {
+        CacheModel cache_model;
+        cache_model.mesh_index = model.mesh_index;
+        for (int c=0; c<4; ++c) {
+            for (int r=0; r<3; ++r) {
+                cache_model.xform[c * 3 + r] = model.xform[c][r];
+            }
+        }
+        file.write((const char*)&cache_model, sizeof(cache_model));
+    }
+
+    for (const auto& mesh : meshes_) {
+        if (!mesh.vertex_array.empty()) {
+            file.write((const char*)&mesh.vertex_array[0],
+                       mesh.vertex_array.size() * sizeof(Vertex));
+        }
+        if (!mesh.element_array.empty()) {
+            file.write((const char*)&mesh.element_array[0],
+                       mesh.element_array.size() * sizeof(unsigned int));
+        }
+        if (!mesh.instance_array.empty()) {
+            file.write((const char*)&mesh.instance_array[0],
+                       mesh.instance_array.size() * sizeof(unsigned int));
+        }
+        for (const auto& lod : mesh.lod_array) {
+            CacheLod cache_lod;
+            cache_lod.first_element = lod.first_element;
+            cache_lod.element_count = lod.element_count;
+            cache_lod.error = lod.error;
+            file.write((const char*)&cache_lod, sizeof(cache_lod));
+        }
+        for (const auto& cluster : mesh.cluster_array) {
+            CacheCluster cache_cluster;
+            cache_cluster.first_element = cluster.first_element;
+            cache_cluster.element_count = cluster.element_count;
+            for (int c=0; c<3; ++c) {
+                cache_cluster.centre[c] = cluster.centre[c];
+                cache_cluster.cone_axis[c] = cluster.cone_axis[c];
+            }
+            cache_cluster.radius = cluster.radius;
+            cache_cluster.cone_cutoff = cluster.cone_cutoff;
+            file.write((const char*)&cache_cluster, sizeof(cache_cluster));
+        }
+    }
+
+    return file.good();
+}
+
+uint32_t MyScene::
+processingKey() const
+{
+    // identifies which load-time passes were baked into the cached meshes
+    const float weld_epsilon = options_.weld_vertices ? options_.weld_epsilon
+                                                      : -1.f;
+    uint32_t words[5] = { options_.weld_vertices ? 1u : 0u,
+                          0u,
+                          options_.optimise_meshes ? 1u : 0u,
+                          options_.generate_lods ? 1u : 0u,
+                          options_.build_clusters ? 1u : 0u };
+    memcpy(&words[1], &weld_epsilon, sizeof(words[1]));
+    uint32_t key = 2166136261u;
+    for (int i=0; i<5; ++i) {
+        key ^= words[i];
+        key *= 16777619u;
+    }
+    return key;
+}
+
+void MyScene::
+processMeshes()
+{
+    if (!options_.weld_vertices && !options_.optimise_meshes
+        && !options_.generate_lods && !options_.build_clusters) {
+        return;
+    }
+
+    std::vector<size_t> unwelded_bytes(meshes_.size());
+    std::vector<size_t> welded_bytes(meshes_.size());
+    std::vector<VertexCacheStatistics> before(meshes_.size());
+    std::vector<VertexCacheStatistics> after(meshes_.size());
+
+    ThreadPool pool;
+    pool.parallelFor(meshes_.size(), [&](int mesh_index) {
+        Mesh& mesh = meshes_[mesh_index];
+        if (options_.weld_vertices) {
+            unwelded_bytes[mesh_index] = mesh.vertex_array.size()
+                                       * sizeof(Vertex);
+            weldVertices(mesh.vertex_array, mesh.element_array,
+                         options_.weld_epsilon);
+            welded_bytes[mesh_index] = mesh.vertex_array.size()
+                                     * sizeof(Vertex);
+        }
+        if (options_.optimise_meshes) {
+            before[mesh_index] = analyseVertexCache(mesh.element_array,
+                                                    mesh.vertex_array.size());
+        }
+        if (options_.build_clusters) {
+            // LODs are not appended yet so this clusters level 0 only.
+            // Clustering regroups the triangles, so the cache and overdraw
+            // orders are then made within and between clusters.
+            buildClusters(mesh.vertex_array, mesh.element_array,
+                          mesh.cluster_array);
+            if (options_.optimise_meshes) {
+                optimiseClusters(mesh.vertex_array, mesh.element_array,
+                                 mesh.cluster_array);
+            }
+        } else if (options_.optimise_meshes) {
+            optimiseVertexCache(mesh.element_array, mesh.vertex_array.size());
+            optimiseOverdraw(mesh.element_array, mesh.vertex_array);
+        }
+        if (options_.optimise_meshes) {
+            // statistics of the element order that is actually drawn
+            optimiseVertexFetch(mesh.vertex_array, mesh.element_array);
+            after[mesh_index] = analyseVertexCache(mesh.element_array,
+                                                   mesh.vertex_array.size());
+        }
+        if (options_.generate_lods) {
+            generateLods(mesh);
+        }
+    });
+
+    for (size_t i=0; i<meshes_.size(); ++i) {
+        std::cout << "Mesh " << i << ":";
+        if (options_.weld_vertices) {
+            std::cout << " welded " << unwelded_bytes[i] / sizeof(Vertex)
+                      << " -> " << welded_bytes[i] / sizeof(Vertex)
+                      << " vertices, saved "
+                      << unwelded_bytes[i] - welded_bytes[i] << " bytes;";
+        }
+        if (options_.optimise_meshes) {
+            std::cout << " ACMR " << before[i].acmr << " -> " << after[i].acmr
+                      << ", ATVR " << before[i].atvr << " -> " << after[i].atvr
+                      << ";";
+        }
+        if (options_.generate_lods) {
+            std::cout << " " << meshes_[i].lod_array.size() << " LODs";
+            for (const auto& lod : meshes_[i].lod_array) {
+                std::cout << " " << lod.element_count / 3;
+            }
+            std::cout << " triangles;";
+        }
+        if (options_.build_clusters) {
+            std::cout << " " << meshes_[i].cluster_array.size() << " clusters";
+        }
+        std::cout << std::endl;
+    }
+}
+
+void MyScene::
+computeBounds()
+{
+    for (auto& mesh : meshes_) {
+        glm::vec3 bounds_min(0.f), bounds_max(0.f);
+        if (!mesh.vertex_array.empty()) {
+            bounds_min = bounds_max = mesh.vertex_array[0].position;
+        }
+        for (const auto& vertex : mesh.vertex_array) {
+            bounds_min = glm::min(bounds_min, vertex.position);
+            bounds_max = glm::max(bounds_max, vertex.position);
+        }
+        mesh.bounds_min = bounds_min;
+        mesh.bounds_max = bounds_max;
+        mesh.bounds_centre = (bounds_min + bounds_max) * 0.5f;
+
+        // the farthest vertex gives a tighter radius than the box corner
+        float radius_sq = 0.f;
+        for (const auto& vertex : mesh.vertex_array) {
+            const glm::vec3 offset = vertex.position - mesh.bounds_centre;
+            radius_sq = std::max(radius_sq, glm::dot(offset, offset));
+        }
+        mesh.bounds_radius = sqrtf(radius_sq);
+    }
+
+    for (auto& model : models_) {
+        computeModelBounds(model);
+    }
+}
+
+void MyScene::
+computeModelBounds(Model& model) const
+{
+    // the model's box encloses its transformed mesh box, the extent
+    // being carried through the absolute transform
+    const Mesh& mesh = meshes_[model.mesh_index];
+    const glm::vec3 centre = model.xform * glm::vec4(mesh.bounds_centre, 1.f);
+    const glm::vec3 extent = (mesh.bounds_max - mesh.bounds_min) * 0.5f;
+    glm::vec3 world_extent(0.f);
+    for (int c=0; c<3; ++c) {
+        world_extent += glm::abs(model.xform[c]) * extent[c];
+    }
+    model.bounds_min = centre - world_extent;
+    model.bounds_max = centre + world_extent;
+}
+
+void MyScene::
+updateHierarchy(bool rebuild)
+{
+    std::vector<glm::vec3> box_mins(models_.size());
+    std::vector<glm::vec3> box_maxs(models_.size());
+    for (unsigned int i=0; i<models_.size(); ++i) {
+        box_mins[i] = models_[i].bounds_min;
+        box_maxs[i] = models_[i].bounds_max;
+    }
+
+    // refitting keeps the tree's shape, which is only worth doing while
+    // the models it was built for are all still there
+    if (rebuild || model_hierarchy_.itemCount() != models_.size()) {
+        model_hierarchy_.build(box_mins, box_maxs);
+    } else {
+        model_hierarchy_.refit(box_mins, box_maxs);
+    }
+    model_hierarchy_stale_ = false;
+}
+
+void MyScene::
+generateLods(Mesh& mesh)
+{
+    // every level is simplified from the full mesh, so its error is
+    // measured against the original surface rather than the level above
+    const std::vector<unsigned int> full_elements(mesh.element_array.begin(),
+        mesh.element_array.begin() + mesh.lod_array[0].element_count);
+    mesh.element_array = full_elements;
+    mesh.lod_array.resize(1);
+
+    for (int level=1; level<kMaxLodCount; ++level) {
+        const size_t target = (full_elements.size() >> level) / 3 * 3;
+        if (target < kMinLodElementCount) {
+            break;
+        }
+        std::vector<unsigned int> lod_elements;
+        const float error = simplifyMesh(mesh.vertex_array, full_elements,
+                                         target, lod_elements);
+
+        // stop once simplification stalls on locked seams and borders
+        const Lod& previous = mesh.lod_array.back();
+        if (lod_elements.size() * 5 > previous.element_count * 4) {
+            break;
+        }
+        optimiseVertexCache(lod_elements, mesh.vertex_array.size());
+
+        Lod lod;
+        lod.first_element = mesh.element_array.size();
+        lod.element_count = lod_elements.size();
+        lod.error = std::max(error, previous.error);
+        mesh.element_array.insert(mesh.element_array.end(),
+                                  lod_elements.begin(), lod_elements.end());
+        mesh.lod_array.push_back(lod);
+    }
+}
+
 void MyScene::
 update()
 {
@@ -125,6 +774,46 @@ update()
     camera_->moveRight(camera_translation_speed_.x * dt);
     camera_->spinHorizontal(camera_rotation_speed_.x * dt);
     camera_->spinVertical(camera_rotation_speed_.y * dt);
+
+    if (model_hierarchy_stale_) {
+        updateHierarchy(false);
+    }
+
+    updateFrameState();
+}
+
+void MyScene::
+updateFrameState()
+{
+    frame_state_.time = time_seconds_;
+
+    Camera& cam = frame_state_.camera;
+    cam.position = camera_->position();
+    cam.direction = camera_->direction();
+    cam.vertical_field_of_view_degrees = 75.f;
+    cam.near_plane_distance = 1.f;
+    cam.far_plane_distance = 1000.f;
+
+    // The light count is fixed, so the array is only allocated once
+    frame_state_.lights.resize(7);
+    for (unsigned int i=0; i<frame_state_.lights.size(); ++i) {
+        Light& light = frame_state_.lights[i];
+        if (i == 0) {
+            light.position = glm::vec3(50.f * cosf(time_seconds_), 50.f, 0.f);
+            light.range = 150.f;
+            light.intensity = glm::vec3(1.f);
+        } else {
+            float A = time_seconds_ + i * 6.28f / 6.f;
+            light.position  = glm::vec3(120.f * cosf(A), 10.f, 40.f * sinf(A));
+            light.range = 80.f;
+            light.intensity = glm::vec3(0.5f + 0.5f * cosf(A),
+                                        0.5f + 0.5f * cosf(A+glm::radians(120.f)),
+                                        0.5f + 0.5f * cosf(A+glm::radians(240.f)));
+        }
+    }
+
+    frame_state_.ambient_light_intensity
+        = glm::vec3(0.1f + 0.1f * cosf(time_seconds_));
 }
 
 float MyScene::
@@ -139,47 +828,34 @@ upDirection() const
     return glm::vec3(0.f, 1.f, 0.f);
 }
 
-MyScene::Camera MyScene::
+const MyScene::Camera& MyScene::
 camera() const
 {
-    Camera cam;
-    cam.position = camera_->position();
-    cam.direction = camera_->direction();
-    cam.vertical_field_of_view_degrees = 75.f;
-    cam.near_plane_distance = 1.f;
-    cam.far_plane_distance = 1000.f;
-    return cam;
+    return frame_state_.camera;
 }
 
 int MyScene::
 lightCount() const
 {
-    return 7;
+    return frame_state_.lights.size();
 }
 
-MyScene::Light MyScene::
+const MyScene::Light& MyScene::
 light(int index) const
 {
-    Light light;
-    if (index == 0) {
-        light.position = glm::vec3(50.f * cosf(time_seconds_), 50.f, 0.f);
-        light.range = 150.f;
-        light.intensity = glm::vec3(1.f);
-    } else {
-        float A = time_seconds_ + index * 6.28f / 6.f;
-        light.position  = glm::vec3(120.f * cosf(A), 10.f, 40.f * sinf(A));
-        light.range = 80.f;
-        light.intensity = glm::vec3(0.5f + 0.5f * cosf(A),
-                                    0.5f + 0.5f * cosf(A+glm::radians(120.f)),
-                                    0.5f + 0.5f * cosf(A+glm::radians(240.f)));
-    }
-    return light;
+    return frame_state_.lights[index];
 }
 
 glm::vec3 MyScene::
 ambientLightIntensity() const
 {
-    return glm::vec3(0.1f + 0.1f * cosf(time_seconds_));
+    return frame_state_.ambient_light_intensity;
+}
+
+const MyScene::FrameState& MyScene::
+frameState() const
+{
+    return frame_state_;
 }
 
 int MyScene::
@@ -188,12 +864,30 @@ materialCount() const
     return materials_.size();
 }
 
-MyScene::Material MyScene::
+const MyScene::Material& MyScene::
 material(int index) const
 {
     return materials_[index];
 }
 
+const std::vector<MyScene::Material>& MyScene::
+materials() const
+{
+    return materials_;
+}
+
+int MyScene::
+textureCount() const
+{
+    return textures_.size();
+}
+
+const std::string& MyScene::
+textureFile(int index) const
+{
+    return textures_[index];
+}
+
 int MyScene::
 meshCount() const
 {
@@ -212,8 +906,136 @@ modelCount() const
     return models_.size();
 }
 
-MyScene::Model MyScene::
+const MyScene::Model& MyScene::
 model(int index) const
 {
     return models_[index];
 }
+
+const std::vector<MyScene::Model>& MyScene::
+models() const
+{
+    return models_;
+}
+
+void MyScene::
+setModelTransform(int index,
+                  const glm::mat4x3& xform)
+{
+    Model& model = models_[index];
+    model.xform = xform;
+    computeModelBounds(model);
+    model_hierarchy_stale_ = true;
+    ++model_revision_;
+}
+
+unsigned int MyScene::
+modelRevision() const
+{
+    return model_revision_;
+}
+
+const BoundingVolumeHierarchy& MyScene::
+modelHierarchy() const
+{
+    return model_hierarchy_;
+}
+
+namespace
+{
+
+/**
+ Moller-Trumbore ray triangle intersection, hitting either side.
+ @return  Distance along the ray in units of direction's length, or
+          FLT_MAX for a miss.
+ */
+float
+intersectTriangle(const glm::vec3& origin,
+                  const glm::vec3& direction,
+                  const glm::vec3& p0,
+                  const glm::vec3& p1,
+                  const glm::vec3& p2)
+{
+    const glm::vec3 edge1 = p1 - p0;
+    const glm::vec3 edge2 = p2 - p0;
+    const glm::vec3 p = glm::cross(direction, edge2);
+    const float det = glm::dot(edge1, p);
+    if (fabsf(det) < 1e-12f) {
+        return FLT_MAX;
+    }
+    const float inv_det = 1.f / det;
+    const glm::vec3 s = origin - p0;
+    const float u = glm::dot(s, p) * inv_det;
+    if (u < 0.f || u > 1.f) {
+        return FLT_MAX;
+    }
+    const glm::vec3 q = glm::cross(s, edge1);
+    const float v = glm::dot(direction, q) * inv_det;
+    if (v < 0.f || u + v > 1.f) {
+        return FLT_MAX;
+    }
+    const float t = glm::dot(edge2, q) * inv_det;
+    return t >= 0.f ? t : FLT_MAX;
+}
+
+} // end anonymous namespace
+
+bool MyScene::
+raycast(glm::vec3 origin,
+        glm::vec3 direction,
+        float max_distance,
+        RayHit& hit) const
+{
+    const float length = glm::length(direction);
+    if (length <= 0.f) {
+        return false;
+    }
+    direction /= length;
+
+    // the ray is carried into each model's local space by the inverse
+    // transform, leaving distances along it unchanged
+    auto hit_test = [&](unsigned int model_index, float distance) -> float {
+        const Model& model = models_[model_index];
+        const Mesh& mesh = meshes_[model.mesh_index];
+        const glm::mat4 inverse_xform = glm::inverse(glm::mat4(model.xform));
+        const glm::vec3 local_origin
+            = glm::vec3(inverse_xform * glm::vec4(origin, 1.f));
+        const glm::vec3 local_direction
+            = glm::vec3(inverse_xform * glm::vec4(direction, 0.f));
+
+        const Lod& lod = mesh.lod_array[0];
+        if (lod.element_count == 0) {
+            return distance;
+        }
+        float nearest = distance;
+        const unsigned int* elements = &mesh.element_array[lod.first_element];
+        for (unsigned int i=0; i+2<lod.element_count; i+=3) {
+            const float t = intersectTriangle(local_origin, local_direction,
+                mesh.vertex_array[elements[i]].position,
+                mesh.vertex_array[elements[i+1]].position,
+                mesh.vertex_array[elements[i+2]].position);
+            nearest = std::min(nearest, t);
+        }
+        return nearest;
+    };
+
+    float distance = max_distance;
+    const int model_index = model_hierarchy_.raycast(origin, direction,
+                                                     distance, hit_test);
+    if (model_index < 0) {
+        return false;
+    }
+    hit.model_index = model_index;
+    hit.distance = distance;
+    hit.position = origin + direction * distance;
+    return true;
+}
+
+void MyScene::
+queryAABB(glm::vec3 box_min,
+          glm::vec3 box_max,
+          std::vector<unsigned int>& model_indices) const
+{
+    model_indices.clear();
+    model_hierarchy_.queryBox(box_min, box_max, model_indices);
+}
@@ -1,18 +1,35 @@
 #pragma once
 
+#include "BoundingVolumeHierarchy.hpp"
 #include <glm/glm.hpp>
 #include <string>
 #include <vector>
 #include <chrono>
 #include <memory>
+#include <cstdint>
 
 class FirstPersonMovement;
 
 class MyScene
 {
 public:
-    
-    MyScene();
+
+    struct LoadOptions
+    {
+        bool weld_vertices;
+        float weld_epsilon;
+        bool optimise_meshes;
+        bool generate_lods;
+        bool build_clusters;
+
+        LoadOptions() : weld_vertices(true),
+                        weld_epsilon(0.f),
+                        optimise_meshes(true),
+                        generate_lods(true),
+                        build_clusters(true) {}
+    };
+
+    MyScene(LoadOptions options = LoadOptions());
 
     ~MyScene();
 
@@ -42,7 +59,7 @@ public:
         float far_plane_distance;
     };
 
-    Camera
+    const Camera&
     camera() const;
 
     struct Light
@@ -55,32 +72,93 @@ public:
     int
     lightCount() const;
 
-    Light
+    const Light&
     light(int index) const;
 
     glm::vec3
     ambientLightIntensity() const;
 
+    /**
+     Everything that changes from frame to frame, captured by update() so
+     a frame reads one consistent copy without rebuilding it.
+     */
+    struct FrameState
+    {
+        float time;
+        Camera camera;
+        std::vector<Light> lights;
+        glm::vec3 ambient_light_intensity;
+    };
+
+    const FrameState&
+    frameState() const;
+
     struct Material
     {
         glm::vec3 colour;
         std::string shininess_map;
+        // index of shininess_map in the scene's textures, or -1 for none
+        int shininess_texture;
     };
 
     int
     materialCount() const;
 
-    Material
+    const Material&
     material(int index) const;
 
+    const std::vector<Material>&
+    materials() const;
+
+    /**
+     Image files referenced by the materials, each listed once.
+     */
+    int
+    textureCount() const;
+
+    const std::string&
+    textureFile(int index) const;
+
+    struct Vertex
+    {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec2 texcoord;
+    };
+
+    struct Lod
+    {
+        unsigned int first_element;
+        unsigned int element_count;
+        float error;
+    };
+
+    struct Cluster
+    {
+        unsigned int first_element;
+        unsigned int element_count;
+        glm::vec3 centre;
+        float radius;
+        // every triangle normal lies within asin(cone_cutoff) of the axis;
+        // a cutoff of one or more means the cluster can never be back-facing
+        glm::vec3 cone_axis;
+        float cone_cutoff;
+    };
+
     struct Mesh
     {
-        std::vector<glm::vec3> position_array;
-        std::vector<glm::vec3> normal_array;
-        std::vector<glm::vec3> tangent_array;
-        std::vector<glm::vec2> texcoord_array;
+        std::vector<Vertex> vertex_array;
         std::vector<unsigned int> element_array;
         std::vector<unsigned int> instance_array;
+        // ranges of element_array, finest first; level 0 is the full mesh
+        std::vector<Lod> lod_array;
+        // small triangle clusters partitioning lod level 0
+        std::vector<Cluster> cluster_array;
+        // local space bounding box, and a sphere about the box's centre
+        glm::vec3 bounds_min;
+        glm::vec3 bounds_max;
+        glm::vec3 bounds_centre;
+        float bounds_radius;
     };
 
     int
@@ -94,19 +172,109 @@ public:
         unsigned int mesh_index;
         unsigned int material_index;
         glm::mat4x3 xform;
+        // world space box enclosing the transformed mesh bounds
+        glm::vec3 bounds_min;
+        glm::vec3 bounds_max;
     };
 
     int
     modelCount() const;
 
-    Model
+    const Model&
     model(int index) const;
 
+    const std::vector<Model>&
+    models() const;
+
+    /**
+     Moves a model, updating its world box. The model hierarchy is refit
+     on the next update().
+     */
+    void
+    setModelTransform(int index,
+                      const glm::mat4x3& xform);
+
+    /**
+     Incremented whenever a model's transform changes, so views can tell
+     when their copies of the model data are stale.
+     */
+    unsigned int
+    modelRevision() const;
+
+    /**
+     Hierarchy over the models' world boxes, item i being model i.
+     */
+    const BoundingVolumeHierarchy&
+    modelHierarchy() const;
+
+    struct RayHit
+    {
+        unsigned int model_index;
+        float distance;
+        glm::vec3 position;
+    };
+
+    /**
+     Finds the nearest triangle of the full detail meshes hit by a ray.
+     @return  False if nothing is hit within max_distance.
+     */
+    bool
+    raycast(glm::vec3 origin,
+            glm::vec3 direction,
+            float max_distance,
+            RayHit& hit) const;
+
+    /**
+     Replaces model_indices with the models whose world box overlaps the
+     given box.
+     */
+    void
+    queryAABB(glm::vec3 box_min,
+              glm::vec3 box_max,
+              std::vector<unsigned int>& model_indices) const;
+
 private:
 
     bool
     readFile(std::string filepath);
 
+    bool
+    readSceneFile(std::string filepath);
+
+    bool
+    readMaterialFile(std::string filepath);
+
+    bool
+    readCacheFile(std::string filepath,
+                  uint64_t source_hash);
+
+    bool
+    writeCacheFile(std::string filepath,
+                   uint64_t source_hash) const;
+
+    uint32_t
+    processingKey() const;
+
+    void
+    processMeshes();
+
+    void
+    computeBounds();
+
+    void
+    computeModelBounds(Model& model) const;
+
+    void
+    updateHierarchy(bool rebuild);
+
+    static void
+    generateLods(Mesh& mesh);
+
+    void
+    updateFrameState();
+
+    LoadOptions options_;
+
     std::chrono::system_clock::time_point start_time_;
     float time_seconds_;
 
@@ -114,9 +282,17 @@ private:
     glm::vec3 camera_translation_speed_;
     glm::vec2 camera_rotation_speed_;
 
+    FrameState frame_state_;
+
     std::vector<Mesh> meshes_;
 
     std::vector<Model> models_;
 
     std::vector<Material> materials_;
+
+    std::vector<std::string> textures_;
+
+    BoundingVolumeHierarchy model_hierarchy_;
+    bool model_hierarchy_stale_;
+    unsigned int model_revision_;
 };
@@ -1,14 +1,238 @@
 #include "MyView.hpp"
 #include "MyScene.hpp"
 #include "FileHelper.hpp"
+#include "StartupProfile.hpp"
+#include "RenderQueue.hpp"
+#include "BoundingSpheres.hpp"
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+namespace
+{
+
+// Uniform buffer binding point of the FrameData block
+const GLuint kFrameDataBinding = 0;
+
+// Texture unit the model data buffer is bound to
+const GLint kModelDataTextureUnit = 1;
+
+// Vertex attribute the per-instance model index is read from
+const GLuint kModelIndexAttribute = 3;
+
+// Models above which bounding spheres are transformed across threads
+const size_t kParallelTransformCount = 16384;
+
+// Fraction of the LOD error threshold a coarser level must be under
+// before a model switches to it
+const float kLodHysteresis = 0.5f;
+
+// Weight of each new GPU time in its configuration's running average
+const float kGpuTimeSmoothing = 0.1f;
+
+// Corners of the unit cube the occlusion boxes are drawn from, corner i
+// having x, y and z from bits 0, 1 and 2 of i
+const GLfloat kBoxCorners[8][3] = {
+	{ 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 },
+	{ 0, 0, 1 }, { 1, 0, 1 }, { 0, 1, 1 }, { 1, 1, 1 }
+};
+
+// Two triangles for each face of the cube, which is drawn without face
+// culling so their winding does not matter
+const GLubyte kBoxElements[36] = {
+	0, 2, 6,  0, 6, 4,
+	1, 5, 7,  1, 7, 3,
+	0, 4, 5,  0, 5, 1,
+	2, 3, 7,  2, 7, 6,
+	0, 1, 3,  0, 3, 2,
+	4, 6, 7,  4, 7, 5
+};
+
+GLuint
+compileShaderFile(GLenum type,
+				  const char* filepath)
+{
+	const GLuint shader = glCreateShader(type);
+	const std::string shader_string = tyga::stringFromFile(filepath);
+	const char *shader_code = shader_string.c_str();
+	glShaderSource(shader, 1, (const GLchar **) &shader_code, NULL);
+	glCompileShader(shader);
+
+	GLint compile_status = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_status);
+	if (compile_status != GL_TRUE)
+	{
+		const int string_length = 1024;
+		GLchar log[string_length] = "";
+		glGetShaderInfoLog(shader, string_length, NULL, log);
+		std::cerr << log << std::endl;
+	}
+	return shader;
+}
+
+void
+linkProgram(GLuint program)
+{
+	glLinkProgram(program);
+
+	GLint link_status = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+	if (link_status != GL_TRUE)
+	{
+		const int string_length = 1024;
+		GLchar log[string_length] = "";
+		glGetProgramInfoLog(program, string_length, NULL, log);
+		std::cerr << log << std::endl;
+	}
+}
+
+GLushort
+floatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const GLushort sign = (bits >> 16) & 0x8000;
+	const int float_exponent = (bits >> 23) & 0xff;
+	const int exponent = float_exponent - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (float_exponent == 0xff)
+		return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+	if (exponent >= 31)
+		return sign | 0x7c00;
+	if (exponent <= 0)
+	{
+		// Too small for a normal half so produce a denormal (or zero)
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		const int shift = 14 - exponent;
+		GLushort half = (GLushort)(mantissa >> shift);
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+
+	// Rounding may carry into the exponent, which is still correct
+	GLushort half = (GLushort)(sign | (exponent << 10) | (mantissa >> 13));
+	if (mantissa & 0x1000)
+		half++;
+	return half;
+}
+
+GLshort
+floatToSnorm16(float value)
+{
+	const float clamped = std::max(-1.0f, std::min(1.0f, value));
+	return (GLshort)(clamped * 32767.0f + (clamped >= 0.0f ? 0.5f : -0.5f));
+}
+
+// Octahedral normal encoding: project onto the octahedron |x|+|y|+|z|=1
+// and fold the lower half over the diagonals into the unit square
+void
+encodeOctahedral(glm::vec3 n, GLshort encoded[2])
+{
+	// A degenerate zero normal encodes as +Z rather than dividing by zero
+	const float length = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if (length <= 0.0f)
+	{
+		encoded[0] = encoded[1] = 0;
+		return;
+	}
+	n /= length;
+	float x = n.x;
+	float y = n.y;
+	if (n.z < 0.0f)
+	{
+		x = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	encoded[0] = floatToSnorm16(x);
+	encoded[1] = floatToSnorm16(y);
+}
+
+// Gribb and Hartmann's extraction of the clip volume planes, which are
+// left unnormalised with the inside in the positive half-space
+void
+extractFrustumPlanes(const glm::mat4& clip_xform, glm::vec4 planes[6])
+{
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++)
+	{
+		rows[r] = glm::vec4(clip_xform[0][r], clip_xform[1][r],
+							clip_xform[2][r], clip_xform[3][r]);
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		planes[i*2] = rows[3] + rows[i];
+		planes[i*2+1] = rows[3] - rows[i];
+	}
+}
+
+// Number of program and texture binds needed to draw the queue in its
+// current order, treating texture slot zero as no texture
+int
+countStateChanges(const RenderQueue& queue)
+{
+	int changes = 0;
+	unsigned int program = ~0u;
+	unsigned int texture = 0;
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		const uint64_t key = queue.key(i);
+		if (RenderQueue::keyProgram(key) != program)
+		{
+			program = RenderQueue::keyProgram(key);
+			changes++;
+		}
+		if (RenderQueue::keyTexture(key) != 0
+			&& RenderQueue::keyTexture(key) != texture)
+		{
+			texture = RenderQueue::keyTexture(key);
+			changes++;
+		}
+	}
+	return changes;
+}
+
+} // end anonymous namespace
 
 MyView::
-MyView()
+MyView() : frame_data_ubo_(0),
+           use_compact_vertices_(false),
+           vertex_vbo_(0),
+           element_vbo_(0),
+           vao_(0),
+           model_data_tbo_(0),
+           model_data_texture_(0),
+           instance_vbo_(0),
+           use_instancing_(true),
+           draw_command_buffer_(0),
+           use_multi_draw_indirect_(true),
+           upload_budget_(0),
+           bytes_streamed_(0),
+           streaming_frames_(0),
+           first_frame_rendered_(false),
+           startup_reported_(false),
+           lod_pixel_error_(1.0f),
+           use_state_cache_(true),
+           model_revision_(0),
+           use_occlusion_culling_(false),
+           frame_index_(0),
+           occlusion_box_vbo_(0),
+           occlusion_box_ebo_(0),
+           occlusion_box_vao_(0),
+           use_depth_prepass_(false),
+           active_gpu_timer_(-1)
 {
+	gpu_time_ms_[0] = 0.0f;
+	gpu_time_ms_[1] = 0.0f;
 }
 
 MyView::
@@ -21,11 +245,477 @@ setScene(std::shared_ptr<const MyScene> scene)
     scene_ = scene;
 }
 
+void MyView::
+setUseCompactVertices(bool yes)
+{
+    use_compact_vertices_ = yes;
+}
+
+MyView::RenderStatistics MyView::
+renderStatistics() const
+{
+    return render_statistics_;
+}
+
+void MyView::
+setUseInstancing(bool yes)
+{
+    use_instancing_ = yes;
+}
+
+void MyView::
+setUseMultiDrawIndirect(bool yes)
+{
+    use_multi_draw_indirect_ = yes;
+}
+
+void MyView::
+setUploadBudget(size_t bytes_per_frame)
+{
+    upload_budget_ = bytes_per_frame;
+}
+
+void MyView::
+setUseStateCache(bool yes)
+{
+    use_state_cache_ = yes;
+}
+
+void MyView::
+setUseOcclusionCulling(bool yes)
+{
+    use_occlusion_culling_ = yes;
+}
+
+void MyView::
+setUseDepthPrepass(bool yes)
+{
+    use_depth_prepass_ = yes;
+}
+
+void MyView::
+queueBufferUpload(Mesh& mesh,
+                  GLuint buffer,
+                  size_t buffer_offset,
+                  const void* data,
+                  size_t size,
+                  bool copy)
+{
+	if (size == 0)
+		return;
+
+	pending_uploads_.push_back(PendingUpload());
+	PendingUpload& upload = pending_uploads_.back();
+	upload.mesh = &mesh;
+	upload.buffer = buffer;
+	upload.buffer_offset = buffer_offset;
+	upload.size = size;
+	if (copy)
+	{
+		upload.storage.assign((const char*)data, (const char*)data + size);
+		upload.data = &upload.storage[0];
+	}
+	else
+	{
+		upload.data = (const char*)data;
+	}
+	mesh.pending_uploads++;
+}
+
+void MyView::
+queueMeshUpload(Mesh& mesh,
+                const std::vector<MyScene::Vertex>& vertices,
+                const std::vector<unsigned int>& elements,
+                size_t& vertex_buffer_size,
+                size_t& element_buffer_size,
+                bool persistent)
+{
+	const size_t vertex_size = use_compact_vertices_ ? sizeof(CompactVertex)
+													 : sizeof(Vertex);
+
+	// Elements are relative to the mesh's base vertex, so meshes with few
+	// enough vertices can use 16-bit elements even in a shared buffer
+	const bool short_elements = use_compact_vertices_
+								&& vertices.size() <= 65536;
+
+	mesh.element_type = short_elements ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	mesh.element_count = elements.size();
+	mesh.compact = use_compact_vertices_;
+	mesh.position_scale = glm::vec3(1.0f, 1.0f, 1.0f);
+	mesh.position_bias = glm::vec3(0.0f, 0.0f, 0.0f);
+	mesh.base_vertex = vertex_buffer_size / vertex_size;
+
+	// Keep 32-bit element ranges aligned after any 16-bit ones
+	element_buffer_size = (element_buffer_size + 3) & ~(size_t)3;
+	mesh.element_offset = element_buffer_size;
+
+	if (use_compact_vertices_)
+	{
+		// Quantise positions to the mesh bounds, which the vertex
+		// shader undoes with position_scale and position_bias
+		std::vector<CompactVertex> compact_vertices;
+		compactVertices(vertices, compact_vertices,
+						mesh.position_scale,
+						mesh.position_bias);
+		queueBufferUpload(mesh, vertex_vbo_, vertex_buffer_size,
+						  compact_vertices.empty() ? nullptr : &compact_vertices[0],
+						  compact_vertices.size() * sizeof(CompactVertex),
+						  true);
+	}
+	else
+	{
+		// MyScene::Vertex matches our interleaved layout, so the
+		// vertices are uploaded as-is
+		queueBufferUpload(mesh, vertex_vbo_, vertex_buffer_size,
+						  vertices.empty() ? nullptr : &vertices[0],
+						  vertices.size() * sizeof(MyScene::Vertex),
+						  !persistent);
+	}
+	vertex_buffer_size += vertices.size() * vertex_size;
+
+	if (short_elements)
+	{
+		std::vector<GLushort> short_elements(elements.begin(), elements.end());
+		queueBufferUpload(mesh, element_vbo_, element_buffer_size,
+						  short_elements.empty() ? nullptr : &short_elements[0],
+						  short_elements.size() * sizeof(GLushort),
+						  true);
+		element_buffer_size += elements.size() * sizeof(GLushort);
+	}
+	else
+	{
+		queueBufferUpload(mesh, element_vbo_, element_buffer_size,
+						  elements.empty() ? nullptr : &elements[0],
+						  elements.size() * sizeof(unsigned int),
+						  !persistent);
+		element_buffer_size += elements.size() * sizeof(unsigned int);
+	}
+}
+
+void MyView::
+streamUploads(size_t byte_budget)
+{
+	size_t spent = 0;
+	while (!pending_uploads_.empty() && spent < byte_budget)
+	{
+		PendingUpload& upload = pending_uploads_.front();
+		if (upload.texture_index >= 0)
+		{
+			spent += uploadTexture(upload.texture_index);
+			pending_uploads_.pop_front();
+			continue;
+		}
+
+		const size_t chunk = std::min(upload.size - upload.uploaded,
+									  byte_budget - spent);
+		ScopedPhaseTimer upload_timer("gl_buffer_upload");
+		glBindBuffer(GL_COPY_WRITE_BUFFER, upload.buffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER,
+						upload.buffer_offset + upload.uploaded, chunk,
+						upload.data + upload.uploaded);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		upload_timer.stop();
+		upload.uploaded += chunk;
+		spent += chunk;
+
+		if (upload.uploaded == upload.size)
+		{
+			upload.mesh->pending_uploads--;
+			pending_uploads_.pop_front();
+		}
+	}
+
+	bytes_streamed_ += spent;
+	streaming_frames_++;
+	if (pending_uploads_.empty() && byte_budget != SIZE_MAX)
+	{
+		std::cout << "Streamed " << bytes_streamed_ << " bytes over "
+				  << streaming_frames_ << " frames" << std::endl;
+	}
+}
+
+size_t MyView::
+uploadTexture(int index)
+{
+	size_t size = 0;
+	ScopedPhaseTimer decode_timer("texture_decode");
+	tyga::Image shininess_image = tyga::imageFromPNG(scene_->textureFile(index));
+	decode_timer.stop();
+	if(shininess_image.containsData())
+	{
+		ScopedPhaseTimer upload_timer("texture_upload");
+		glGenTextures(1, &textures_[index].id);
+		glBindTexture(GL_TEXTURE_2D, textures_[index].id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+										GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexImage2D(GL_TEXTURE_2D,
+					 0,
+					 GL_RGBA,
+					 shininess_image.width(),
+					 shininess_image.height(),
+					 0,
+					 shininess_image.componentsPerPixel() == 4 ? GL_RGBA : GL_RGB,
+					 shininess_image.bytesPerComponent() == 1 ? GL_UNSIGNED_BYTE
+															: GL_UNSIGNED_SHORT,
+					 shininess_image.pixels());
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		size = shininess_image.width() * shininess_image.height()
+			   * shininess_image.componentsPerPixel()
+			   * shininess_image.bytesPerComponent();
+	}
+
+	// A missing map still counts as resident so its models are drawn
+	textures_[index].resident = true;
+	return size;
+}
+
+int MyView::
+selectLod(unsigned int model_index,
+          const Mesh& mesh,
+          const glm::vec4& world_sphere,
+          float scale,
+          glm::vec3 camera_position,
+          float near_plane_distance,
+          float pixels_per_unit)
+{
+	const int lod_count = mesh.lods.size();
+	if (lod_count < 2)
+		return 0;
+
+	// Distance from the camera to the nearest point of the world space
+	// bounding sphere
+	const float distance = std::max(glm::distance(glm::vec3(world_sphere), camera_position)
+									- world_sphere.w,
+									near_plane_distance);
+	const float pixels_per_error = scale * pixels_per_unit / distance;
+
+	// Refine as soon as the current level is too coarse, but only coarsen
+	// once the next level is well under the threshold so models near the
+	// switching distance do not pop back and forth
+	int level = std::min(model_lod_[model_index], lod_count - 1);
+	while (level > 0
+		   && mesh.lods[level].error * pixels_per_error > lod_pixel_error_)
+		level--;
+	while (level + 1 < lod_count
+		   && mesh.lods[level+1].error * pixels_per_error
+			  < lod_pixel_error_ * kLodHysteresis)
+		level++;
+
+	model_lod_[model_index] = level;
+	return level;
+}
+
+void MyView::
+pushDrawCommand(unsigned int texture,
+                GLenum element_type,
+                const DrawCommand& command)
+{
+	if (draw_batches_.empty()
+		|| draw_batches_.back().texture != texture
+		|| draw_batches_.back().element_type != element_type)
+	{
+		DrawBatch batch;
+		batch.texture = texture;
+		batch.element_type = element_type;
+		batch.first_command = draw_commands_.size();
+		batch.command_count = 0;
+		draw_batches_.push_back(batch);
+	}
+	draw_commands_.push_back(command);
+	draw_batches_.back().command_count++;
+}
+
+int MyView::
+submitDrawBatch(const DrawBatch& batch)
+{
+	const size_t element_size = batch.element_type == GL_UNSIGNED_SHORT
+								? sizeof(GLushort) : sizeof(GLuint);
+	const size_t end = batch.first_command + batch.command_count;
+
+	int submission_count = 0;
+	for (size_t c = batch.first_command; c < end;)
+	{
+		const DrawCommand& command = draw_commands_[c];
+		glVertexAttribIPointer(kModelIndexAttribute, 1, GL_INT, 0,
+							   TGL_BUFFER_OFFSET(command.base_instance * sizeof(GLint)));
+
+		if (command.instance_count != 1)
+		{
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.element_count,
+											  batch.element_type,
+											  TGL_BUFFER_OFFSET(command.first_element
+																* element_size),
+											  command.instance_count,
+											  command.base_vertex);
+			submission_count++;
+			c++;
+			continue;
+		}
+
+		// Single instance commands of the same model, such as its visible
+		// clusters, still go in one call
+		cluster_counts_.clear();
+		cluster_offsets_.clear();
+		cluster_base_vertices_.clear();
+		for (; c < end && draw_commands_[c].instance_count == 1
+			   && draw_commands_[c].base_instance == command.base_instance; c++)
+		{
+			cluster_counts_.push_back(draw_commands_[c].element_count);
+			cluster_offsets_.push_back(
+				TGL_BUFFER_OFFSET(draw_commands_[c].first_element * element_size));
+			cluster_base_vertices_.push_back(draw_commands_[c].base_vertex);
+		}
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, &cluster_counts_[0],
+									  batch.element_type, &cluster_offsets_[0],
+									  cluster_counts_.size(),
+									  &cluster_base_vertices_[0]);
+		submission_count++;
+	}
+	return submission_count;
+}
+
+void MyView::
+pushClusterCommands(unsigned int texture,
+                    const Mesh& mesh,
+                    GLuint instance,
+                    const glm::mat4& model_xform,
+                    glm::vec3 camera_position,
+                    const glm::vec4 frustum_planes[6])
+{
+	// Work in the model's space, which keeps the cluster data untouched;
+	// a plane maps to model space by multiplying with the model transform
+	glm::vec4 local_planes[6];
+	for (int p = 0; p < 6; p++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			local_planes[p][c] = glm::dot(frustum_planes[p], model_xform[c]);
+		}
+	}
+	const glm::vec3 local_camera = glm::vec3(glm::inverse(model_xform)
+											 * glm::vec4(camera_position, 1.0f));
+
+	const size_t element_size = mesh.element_type == GL_UNSIGNED_SHORT
+								? sizeof(GLushort) : sizeof(GLuint);
+	DrawCommand command;
+	command.element_count = 0;
+	command.instance_count = 1;
+	command.first_element = 0;
+	command.base_vertex = mesh.base_vertex;
+	command.base_instance = instance;
+
+	for (const auto& cluster : mesh.clusters)
+	{
+		bool visible = true;
+		for (int p = 0; p < 6 && visible; p++)
+		{
+			const glm::vec3 normal = glm::vec3(local_planes[p]);
+			visible = glm::dot(normal, cluster.centre) + local_planes[p].w
+					  >= -cluster.radius * glm::length(normal);
+		}
+
+		// Every triangle faces away when the whole bounding sphere lies
+		// inside the cone of view directions that see only back faces
+		const glm::vec3 to_cluster = cluster.centre - local_camera;
+		if (visible && cluster.cone_cutoff < 1.0f
+			&& glm::dot(to_cluster, cluster.cone_axis)
+			   >= cluster.cone_cutoff * glm::length(to_cluster) + cluster.radius)
+			visible = false;
+
+		if (!visible)
+			continue;
+
+		// Neighbouring visible clusters are merged into one range
+		const GLuint first_element = mesh.element_offset / element_size
+									 + cluster.first_element;
+		if (command.element_count > 0
+			&& first_element == command.first_element + command.element_count)
+		{
+			command.element_count += cluster.element_count;
+		}
+		else
+		{
+			if (command.element_count > 0)
+				pushDrawCommand(texture, mesh.element_type, command);
+			command.first_element = first_element;
+			command.element_count = cluster.element_count;
+		}
+	}
+
+	if (command.element_count > 0)
+		pushDrawCommand(texture, mesh.element_type, command);
+}
+
+void MyView::
+compactVertices(const std::vector<MyScene::Vertex>& vertices,
+                std::vector<CompactVertex>& compact_vertices,
+                glm::vec3& position_scale,
+                glm::vec3& position_bias)
+{
+	glm::vec3 bounds_min(0.0f, 0.0f, 0.0f);
+	glm::vec3 bounds_max(0.0f, 0.0f, 0.0f);
+	if (!vertices.empty())
+	{
+		bounds_min = bounds_max = vertices[0].position;
+	}
+	for (const auto& vertex : vertices)
+	{
+		bounds_min = glm::min(bounds_min, vertex.position);
+		bounds_max = glm::max(bounds_max, vertex.position);
+	}
+
+	// The range is the mesh's exact extent with no padding, so its
+	// extreme vertices land on 0 and 65535
+	position_bias = bounds_min;
+	position_scale = bounds_max - bounds_min;
+	glm::vec3 inverse_scale(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < 3; i++)
+	{
+		if (position_scale[i] > 0.0f)
+			inverse_scale[i] = 65535.0f / position_scale[i];
+	}
+
+	compact_vertices.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		const glm::vec3 position = (vertices[i].position - bounds_min) * inverse_scale;
+		for (int c = 0; c < 3; c++)
+		{
+			compact_vertices[i].position[c] = (GLushort)(std::min(position[c], 65535.0f) + 0.5f);
+		}
+		compact_vertices[i].position[3] = 0;
+		encodeOctahedral(vertices[i].normal, compact_vertices[i].normal);
+		compact_vertices[i].texCoord[0] = floatToHalf(vertices[i].texcoord.x);
+		compact_vertices[i].texCoord[1] = floatToHalf(vertices[i].texcoord.y);
+	}
+}
+
+void MyView::ShaderProgram::
+resolveUniformLocations()
+{
+	uniforms.model_data = glGetUniformLocation(program, "model_data");
+	uniforms.shininess_texture = glGetUniformLocation(program, "shininess_texture");
+	uniforms.box_min = glGetUniformLocation(program, "box_min");
+	uniforms.box_max = glGetUniformLocation(program, "box_max");
+
+	const GLuint frame_data_index = glGetUniformBlockIndex(program, "FrameData");
+	if (frame_data_index != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, frame_data_index, kFrameDataBinding);
+}
+
 void MyView::
 windowViewWillStart(std::shared_ptr<tyga::Window> window)
 {
     assert(scene_ != nullptr);
 
+	// Everything the view does to GL goes through the state cache
+	tglEnableStateCache(use_state_cache_ ? GL_TRUE : GL_FALSE);
+	tglResetStateCacheCounts();
+
 	/*
 	*	This section is where we set up the
 	*	Shader Program. The vertex and fragment
@@ -34,40 +724,17 @@ windowViewWillStart(std::shared_ptr<tyga::Window> window)
 	*	to the Shader Program.
 	*/
 
-	GLint compile_status = 0;
+	ScopedPhaseTimer shader_timer("shader_compile_link");
 
 	// Compile the Vertex Shader
 
-	sponza_shader_program_.vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-	std::string vertex_shader_string = tyga::stringFromFile("sponza_vs.glsl");
-	const char *vertex_shader_code = vertex_shader_string.c_str();
-	glShaderSource(sponza_shader_program_.vertex_shader, 1,
-					(const GLchar **) &vertex_shader_code, NULL);
-	glCompileShader(sponza_shader_program_.vertex_shader);
-	glGetShaderiv(sponza_shader_program_.vertex_shader, GL_COMPILE_STATUS, &compile_status);
-	if (compile_status != GL_TRUE)
-	{
-		const int string_length = 1024;
-		GLchar log[string_length] = "";
-		glGetShaderInfoLog(sponza_shader_program_.vertex_shader, string_length, NULL, log);
-		std::cerr << log << std::endl;
-	}
+	sponza_shader_program_.vertex_shader
+		= compileShaderFile(GL_VERTEX_SHADER, "sponza_vs.glsl");
 
 	// Compile the Fragment Shader
 
-	sponza_shader_program_.fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	std::string fragment_shader_string = tyga::stringFromFile("sponza_fs.glsl");
-	const char *fragment_shader_code = fragment_shader_string.c_str();
-	glShaderSource(sponza_shader_program_.fragment_shader, 1,
-					(const GLchar **) &fragment_shader_code, NULL);
-	glGetShaderiv(sponza_shader_program_.fragment_shader, GL_COMPILE_STATUS, &compile_status);
-	if (compile_status != GL_TRUE)
-	{
-		const int string_length = 1024;
-		GLchar log[string_length] = "";
-		glGetShaderInfoLog(sponza_shader_program_.fragment_shader, string_length, NULL, log);
-		std::cerr << log << std::endl;
-	}
+	sponza_shader_program_.fragment_shader
+		= compileShaderFile(GL_FRAGMENT_SHADER, "sponza_fs.glsl");
 
 	// Create the shader program
 
@@ -76,19 +743,64 @@ windowViewWillStart(std::shared_ptr<tyga::Window> window)
 	glBindAttribLocation(sponza_shader_program_.program, 0, "position");
 	glBindAttribLocation(sponza_shader_program_.program, 1, "normal");
 	glBindAttribLocation(sponza_shader_program_.program, 2, "texture_coord");
+	glBindAttribLocation(sponza_shader_program_.program, kModelIndexAttribute, "model_index");
 	glAttachShader(sponza_shader_program_.program, sponza_shader_program_.fragment_shader);
 	glBindAttribLocation(sponza_shader_program_.program, 0, "fragment_colour");
-	glLinkProgram(sponza_shader_program_.program);
+	linkProgram(sponza_shader_program_.program);
 
-	GLint link_status = 0;
-	glGetProgramiv(sponza_shader_program_.program, GL_LINK_STATUS, &link_status);
-	if (link_status != GL_TRUE)
-	{
-		const int string_length = 1024;
-		GLchar log[string_length] = "";
-		glGetProgramInfoLog(sponza_shader_program_.program, string_length, NULL, log);
-		std::cerr << log << std::endl;
-	}
+	sponza_shader_program_.resolveUniformLocations();
+
+	// The shininess map is always bound to the first texture unit
+	// and the model data to the second
+	glUseProgram(sponza_shader_program_.program);
+	glUniform1i(sponza_shader_program_.uniforms.shininess_texture, 0);
+	glUniform1i(sponza_shader_program_.uniforms.model_data, kModelDataTextureUnit);
+	glUseProgram(0);
+
+	// The occlusion program draws a model's world box from a unit cube
+
+	occlusion_shader_program_.vertex_shader
+		= compileShaderFile(GL_VERTEX_SHADER, "occlusion_vs.glsl");
+	occlusion_shader_program_.fragment_shader
+		= compileShaderFile(GL_FRAGMENT_SHADER, "occlusion_fs.glsl");
+	occlusion_shader_program_.program = glCreateProgram();
+	glAttachShader(occlusion_shader_program_.program, occlusion_shader_program_.vertex_shader);
+	glBindAttribLocation(occlusion_shader_program_.program, 0, "position");
+	glAttachShader(occlusion_shader_program_.program, occlusion_shader_program_.fragment_shader);
+	linkProgram(occlusion_shader_program_.program);
+	occlusion_shader_program_.resolveUniformLocations();
+
+	// The depth program places vertices exactly as the sponza program
+	// does, so the main pass can test for equal depth after it
+
+	depth_shader_program_.vertex_shader
+		= compileShaderFile(GL_VERTEX_SHADER, "depth_vs.glsl");
+	depth_shader_program_.fragment_shader
+		= compileShaderFile(GL_FRAGMENT_SHADER, "depth_fs.glsl");
+	depth_shader_program_.program = glCreateProgram();
+	glAttachShader(depth_shader_program_.program, depth_shader_program_.vertex_shader);
+	glBindAttribLocation(depth_shader_program_.program, 0, "position");
+	glBindAttribLocation(depth_shader_program_.program, kModelIndexAttribute, "model_index");
+	glAttachShader(depth_shader_program_.program, depth_shader_program_.fragment_shader);
+	linkProgram(depth_shader_program_.program);
+	depth_shader_program_.resolveUniformLocations();
+
+	glUseProgram(depth_shader_program_.program);
+	glUniform1i(depth_shader_program_.uniforms.model_data, kModelDataTextureUnit);
+	glUseProgram(0);
+
+	shader_timer.stop();
+
+	// Create the buffer for the per-frame uniform block, which is
+	// refilled every frame
+
+	static_assert(sizeof(FrameData) == 64 + 16 + 16 + 32 * kMaxLights,
+				  "FrameData must match the std140 layout of the shader block");
+	glGenBuffers(1, &frame_data_ubo_);
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_data_ubo_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, kFrameDataBinding, frame_data_ubo_);
 
 	//																							//
 	//																							//
@@ -98,64 +810,59 @@ windowViewWillStart(std::shared_ptr<tyga::Window> window)
 
 	// Create the mesh vector list from the scene data
 
+	static_assert(sizeof(Vertex) == sizeof(MyScene::Vertex)
+				  && offsetof(Vertex, normal) == offsetof(MyScene::Vertex, normal)
+				  && offsetof(Vertex, texCoord) == offsetof(MyScene::Vertex, texcoord),
+				  "scene vertices must match the layout of our vertex attributes");
+
+	ScopedPhaseTimer prepare_timer("mesh_upload_prepare");
+
 	meshes_.resize(scene_->meshCount()); // Extend for extra models
 
+	// Every mesh is placed in one vertex and one element buffer, whose
+	// contents are queued and streamed in by windowViewRender
+
+	glGenBuffers(1, &vertex_vbo_);
+	glGenBuffers(1, &element_vbo_);
+	size_t vertex_buffer_size = 0;
+	size_t element_buffer_size = 0;
+
 	for(unsigned int m = 0; m < meshes_.size(); m++)
 	{
-		// Take the vertices from the scene mesh
-		std::vector<Vertex> vertices(scene_->mesh(m).position_array.size());
-		for(unsigned int i = 0; i < vertices.size(); i++)
-		{
-			vertices[i].position = scene_->mesh(m).position_array[i];
-			vertices[i].normal = scene_->mesh(m).normal_array[i];
-			vertices[i].texCoord = scene_->mesh(m).texcoord_array[i];
-		}
-
-		// Take the element from the scene mesh
-		std::vector<unsigned int> elements(scene_->mesh(m).element_array.size());
-		for(unsigned int i = 0; i < elements.size(); i++)
-		{
-			elements[i] = scene_->mesh(m).element_array[i];
-		}
+		const MyScene::Mesh& scene_mesh = scene_->mesh(m);
+		const std::vector<MyScene::Vertex>& vertices = scene_mesh.vertex_array;
 
-		// Generate a vertex buffer object for the mesh's vertices
+		queueMeshUpload(meshes_[m], vertices, scene_mesh.element_array,
+						vertex_buffer_size, element_buffer_size, true);
+		meshes_[m].lods = scene_mesh.lod_array;
+		meshes_[m].clusters = scene_mesh.cluster_array;
 
-		glGenBuffers(1, &meshes_[m].vertex_vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, meshes_[m].vertex_vbo);
-		glBufferData(GL_ARRAY_BUFFER,
-						vertices.size() * sizeof(Vertex),
-						&vertices[0],
-						GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		// Bounding sphere used to measure the mesh's distance for LOD
+		meshes_[m].bounds_centre = scene_mesh.bounds_centre;
+		meshes_[m].bounds_radius = scene_mesh.bounds_radius;
+	}
 
-		// Generate a vertex buffer object for the mesh's elements
+	prepare_timer.stop();
 
-		glGenBuffers(1, &meshes_[m].element_vbo);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshes_[m].element_vbo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-						elements.size() * sizeof(unsigned int),
-						&elements[0],
-						GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-		meshes_[m].element_count = elements.size();
+	// Every model starts at full detail
+	model_lod_.assign(scene_->modelCount(), 0);
 
-		// Generate the Vertex Array Object for the mesh
+	// Gather each model's mesh bounds next to its transform, ready for
+	// the per-frame batch into world space
+	const std::vector<MyScene::Model>& scene_models = scene_->models();
+	model_local_spheres_.resize(scene_models.size());
+	for (unsigned int i = 0; i < scene_models.size(); i++)
+	{
+		const Mesh& mesh = meshes_[scene_models[i].mesh_index];
+		model_local_spheres_[i] = glm::vec4(mesh.bounds_centre, mesh.bounds_radius);
+	}
+	model_world_spheres_.resize(scene_models.size());
+	model_scales_.resize(scene_models.size());
 
-		glGenVertexArrays(1, &meshes_[m].vao);
-		glBindVertexArray(meshes_[m].vao);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshes_[m].element_vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, meshes_[m].vertex_vbo);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-								sizeof(Vertex), TGL_BUFFER_OFFSET(0));
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-								sizeof(Vertex), TGL_BUFFER_OFFSET(sizeof(glm::vec3)));
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE,
-								sizeof(Vertex), TGL_BUFFER_OFFSET((sizeof(glm::vec3)) * 2));
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
+	model_visible_.resize(scene_models.size());
+	if (scene_models.size() > kParallelTransformCount)
+	{
+		transform_pool_.reset(new ThreadPool());
 	}
 
 	/*
@@ -312,81 +1019,213 @@ windowViewWillStart(std::shared_ptr<tyga::Window> window)
 
 	small_model_xform = translate * scale;
 
-	// Generate a vertex buffer object for the pyramid's vertices
+	// Queue the pyramid after the scene's meshes, in the same vertex
+	// format as them
+
+	std::vector<MyScene::Vertex> pyramid_scene_vertices(vertex_count);
+	for (unsigned int i = 0; i < vertex_count; i++)
+	{
+		pyramid_scene_vertices[i].position = pyramid_vertices[i].position;
+		pyramid_scene_vertices[i].normal = pyramid_vertices[i].normal;
+		pyramid_scene_vertices[i].texcoord = pyramid_vertices[i].texCoord;
+	}
+	queueMeshUpload(pyramid_mesh_, pyramid_scene_vertices, elements,
+					vertex_buffer_size, element_buffer_size, false);
+
+	MyScene::Lod pyramid_lod;
+	pyramid_lod.first_element = 0;
+	pyramid_lod.element_count = elements.size();
+	pyramid_lod.error = 0.0f;
+	pyramid_mesh_.lods.assign(1, pyramid_lod);
 
-	glGenBuffers(1, &pyramid_mesh_.vertex_vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pyramid_mesh_.vertex_vbo);
-	glBufferData(GL_ARRAY_BUFFER,
-					pyramid_vertices.size() * sizeof(Vertex),
-					&pyramid_vertices[0],
-					GL_STATIC_DRAW);
+	// Allocate the shared buffers now every mesh has been placed
+
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, nullptr, GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	
-	// Generate a vertex buffer object for the pyramid's elements
-	glGenBuffers(1, &pyramid_mesh_.element_vbo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pyramid_mesh_.element_vbo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-					elements.size() * sizeof(unsigned int),
-					&elements[0],
-					GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	pyramid_mesh_.element_count = elements.size();
-
-	// Generate the Vertex Array Object for the pyramid
-
-	glGenVertexArrays(1, &pyramid_mesh_.vao);
-	glBindVertexArray(pyramid_mesh_.vao);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pyramid_mesh_.element_vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pyramid_mesh_.vertex_vbo);
+
+	// Generate the single Vertex Array Object every mesh is drawn with
+
+	glGenVertexArrays(1, &vao_);
+	glBindVertexArray(vao_);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_vbo_);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, element_buffer_size, nullptr, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_vbo_);
+	if (use_compact_vertices_)
+	{
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+								sizeof(CompactVertex),
+								TGL_BUFFER_OFFSET(offsetof(CompactVertex, position)));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE,
+								sizeof(CompactVertex),
+								TGL_BUFFER_OFFSET(offsetof(CompactVertex, normal)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE,
+								sizeof(CompactVertex),
+								TGL_BUFFER_OFFSET(offsetof(CompactVertex, texCoord)));
+	}
+	else
+	{
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
+								sizeof(Vertex), TGL_BUFFER_OFFSET(0));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
+								sizeof(Vertex), TGL_BUFFER_OFFSET(sizeof(glm::vec3)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE,
+								sizeof(Vertex), TGL_BUFFER_OFFSET((sizeof(glm::vec3)) * 2));
+	}
+
+	// The instance list is refilled every frame, and each draw's model
+	// indices start at its base instance
+	glGenBuffers(1, &instance_vbo_);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
+	glEnableVertexAttribArray(kModelIndexAttribute);
+	glVertexAttribIPointer(kModelIndexAttribute, 1, GL_INT, 0, TGL_BUFFER_OFFSET(0));
+	glVertexAttribDivisor(kModelIndexAttribute, 1);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	// Commands are submitted from a buffer when the context can, and
+	// refilled every frame. Their base instances locate each draw's model
+	// indices, so tgl only offers multi-draw indirect with base instance.
+
+	use_multi_draw_indirect_ = use_multi_draw_indirect_
+		&& tglIsAvailable(TGL_EXTENSION_ARB_MULTI_DRAW_INDIRECT);
+	if (use_multi_draw_indirect_)
+	{
+		glGenBuffers(1, &draw_command_buffer_);
+	}
+	std::cout << (use_multi_draw_indirect_ ? "Submitting with multi-draw indirect"
+										   : "Submitting draw by draw") << std::endl;
+
+	// Each model keeps its own occlusion query across frames, so its
+	// result can be read whenever it arrives
+
+	glGenVertexArrays(1, &occlusion_box_vao_);
+	glBindVertexArray(occlusion_box_vao_);
+
+	glGenBuffers(1, &occlusion_box_vbo_);
+	glBindBuffer(GL_ARRAY_BUFFER, occlusion_box_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(kBoxCorners), kBoxCorners, GL_STATIC_DRAW);
 	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-							sizeof(Vertex), TGL_BUFFER_OFFSET(0));
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-							sizeof(Vertex), TGL_BUFFER_OFFSET(sizeof(glm::vec3)));
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE,
-							sizeof(Vertex), TGL_BUFFER_OFFSET((sizeof(glm::vec3)) * 2));
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, TGL_BUFFER_OFFSET(0));
+
+	glGenBuffers(1, &occlusion_box_ebo_);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, occlusion_box_ebo_);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kBoxElements), kBoxElements, GL_STATIC_DRAW);
+
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 
-	// Load specular maps into texture files
+	occlusion_queries_.resize(scene_->modelCount());
+	for (unsigned int i = 0; i < occlusion_queries_.size(); i++)
+	{
+		glGenQueries(1, &occlusion_queries_[i].query);
+	}
+
+	// A few frames' GPU timers are kept in flight so reading one back
+	// never waits on the GPU
 
-	for(unsigned int i = 0; i < 3; i++)
+	for (int t = 0; t < kGpuTimerCount; t++)
 	{
-		tyga::Image shininess_image = tyga::imageFromPNG("shin" + std::to_string(i+1) + ".png");
-		if(shininess_image.containsData())
-		{
-			glGenTextures(1, &shininess_textures_[i]);
-			glBindTexture(GL_TEXTURE_2D, shininess_textures_[i]);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-											GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexImage2D(GL_TEXTURE_2D,
-						 0,
-						 GL_RGBA,
-						 shininess_image.width(),
-						 shininess_image.height(),
-						 0,
-						 shininess_image.componentsPerPixel() == 4 ? GL_RGBA : GL_RGB,
-						 shininess_image.bytesPerComponent() == 1 ? GL_UNSIGNED_BYTE
-																: GL_UNSIGNED_SHORT,
-						 shininess_image.pixels());
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
-		}
+		glGenQueries(1, &gpu_timers_[t].query);
+	}
+
+	// Resolve the scene's materials into the colour and texture slot
+	// each draw needs, so the render loop does no string work
+
+	materials_.resize(scene_->materialCount());
+	for (unsigned int i = 0; i < materials_.size(); i++)
+	{
+		const MyScene::Material& material = scene_->material(i);
+		materials_[i].colour = material.colour;
+		materials_[i].texture = material.shininess_texture;
 	}
 
+	// Pack the per-model data the shaders fetch by index
+
+	glGenBuffers(1, &model_data_tbo_);
+	glGenTextures(1, &model_data_texture_);
+	uploadModelData();
+	model_revision_ = scene_->modelRevision();
+
+	// Queue the specular maps, which are decoded when their turn comes
+
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
+	textures_.resize(scene_->textureCount());
+	for (unsigned int i = 0; i < textures_.size(); i++)
+	{
+		pending_uploads_.push_back(PendingUpload());
+		pending_uploads_.back().texture_index = i;
+	}
+
+	// Without a budget everything is resident before the first frame
+
+	if (upload_budget_ == 0)
+	{
+		streamUploads(SIZE_MAX);
+	}
+
 	// Enable depth test and cull face test
 
 	glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
 }
 
+void MyView::
+uploadModelData()
+{
+	std::vector<ModelData> model_data(scene_->modelCount() + 2);
+
+	for (unsigned int i = 0; i < model_data.size(); i++)
+	{
+		glm::mat4 xform;
+		const Mesh* mesh = &pyramid_mesh_;
+		glm::vec3 colour(1.0f, 1.0f, 1.0f);
+		bool specular = false;
+		if (i < (unsigned int)scene_->modelCount())
+		{
+			const MyScene::Model& model = scene_->model(i);
+			const Material& material = materials_[model.material_index];
+			xform = glm::mat4(model.xform);
+			mesh = &meshes_[model.mesh_index];
+			colour = material.colour;
+			specular = material.texture >= 0;
+		}
+		else
+		{
+			xform = i == (unsigned int)scene_->modelCount() ? big_model_xform
+															: small_model_xform;
+		}
+
+		for (int r = 0; r < 3; r++)
+		{
+			model_data[i].xform_rows[r] = glm::vec4(xform[0][r], xform[1][r],
+													xform[2][r], xform[3][r]);
+		}
+		model_data[i].colour_specular = glm::vec4(colour, specular ? 1.0f : 0.0f);
+		model_data[i].scale_compact = glm::vec4(mesh->position_scale,
+												mesh->compact ? 1.0f : 0.0f);
+		model_data[i].bias_checkered = glm::vec4(mesh->position_bias,
+												 mesh == &pyramid_mesh_ ? 1.0f : 0.0f);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, model_data_tbo_);
+	glBufferData(GL_TEXTURE_BUFFER, model_data.size() * sizeof(ModelData),
+					&model_data[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glBindTexture(GL_TEXTURE_BUFFER, model_data_texture_);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, model_data_tbo_);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
 void MyView::
 windowViewDidReset(std::shared_ptr<tyga::Window> window,
                    int width,
@@ -405,21 +1244,49 @@ windowViewDidStop(std::shared_ptr<tyga::Window> window)
 	if (sponza_shader_program_.program != 0)
 		glDeleteProgram(sponza_shader_program_.program);
 
-	for(unsigned int m = 0; m < meshes_.size(); m++)
+	glDeleteBuffers(1, &vertex_vbo_);
+	glDeleteBuffers(1, &element_vbo_);
+	glDeleteVertexArrays(1, &vao_);
+
+	glDeleteBuffers(1, &frame_data_ubo_);
+	glDeleteBuffers(1, &model_data_tbo_);
+	glDeleteTextures(1, &model_data_texture_);
+	glDeleteBuffers(1, &instance_vbo_);
+	glDeleteBuffers(1, &draw_command_buffer_);
+
+	if (occlusion_shader_program_.vertex_shader != 0)
+		glDeleteShader(occlusion_shader_program_.vertex_shader);
+	if (occlusion_shader_program_.fragment_shader != 0)
+		glDeleteShader(occlusion_shader_program_.fragment_shader);
+	if (occlusion_shader_program_.program != 0)
+		glDeleteProgram(occlusion_shader_program_.program);
+	glDeleteBuffers(1, &occlusion_box_vbo_);
+	glDeleteBuffers(1, &occlusion_box_ebo_);
+	glDeleteVertexArrays(1, &occlusion_box_vao_);
+	for (unsigned int i = 0; i < occlusion_queries_.size(); i++)
 	{
-		glDeleteBuffers(1, &meshes_[m].vertex_vbo);
-		glDeleteBuffers(1, &meshes_[m].element_vbo);
-		glDeleteVertexArrays(1, &meshes_[m].vao);
+		glDeleteQueries(1, &occlusion_queries_[i].query);
+	}
+	occlusion_queries_.clear();
+
+	if (depth_shader_program_.vertex_shader != 0)
+		glDeleteShader(depth_shader_program_.vertex_shader);
+	if (depth_shader_program_.fragment_shader != 0)
+		glDeleteShader(depth_shader_program_.fragment_shader);
+	if (depth_shader_program_.program != 0)
+		glDeleteProgram(depth_shader_program_.program);
+	for (int t = 0; t < kGpuTimerCount; t++)
+	{
+		glDeleteQueries(1, &gpu_timers_[t].query);
+		gpu_timers_[t] = GpuTimer();
 	}
 
-	glDeleteBuffers(1, &pyramid_mesh_.vertex_vbo);
-	glDeleteBuffers(1, &pyramid_mesh_.element_vbo);
-	glDeleteVertexArrays(1, &pyramid_mesh_.vao);
-
-	for(unsigned int i = 0; i < 3; i++)
+	for (unsigned int i = 0; i < textures_.size(); i++)
 	{
-		glDeleteTextures(1, &shininess_textures_[i]);
+		glDeleteTextures(1, &textures_[i].id);
 	}
+
+	tglEnableStateCache(GL_FALSE);
 }
 
 void MyView::
@@ -432,6 +1299,52 @@ windowViewRender(std::shared_ptr<tyga::Window> window)
     glClearColor(0.f, 0.f, 0.25f, 0.f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	if (!first_frame_rendered_)
+	{
+		StartupProfile::instance().mark("first_frame");
+		first_frame_rendered_ = true;
+	}
+
+	// Continue streaming the scene in
+
+	if (!pending_uploads_.empty())
+	{
+		streamUploads(upload_budget_);
+	}
+
+	// Report where startup went once the whole scene is resident
+
+	if (!startup_reported_ && pending_uploads_.empty())
+	{
+		StartupProfile& profile = StartupProfile::instance();
+		profile.mark("scene_resident");
+		profile.printSummary(std::cout);
+		if (!profile.writeJson("startup_profile.json"))
+			std::cerr << "Failed to write startup_profile.json" << std::endl;
+		startup_reported_ = true;
+	}
+
+	// Read the scene's state for this frame once, by reference
+	const MyScene::FrameState& frame = scene_->frameState();
+	const MyScene::Camera& camera = frame.camera;
+	const std::vector<MyScene::Model>& models = scene_->models();
+
+	// Repack the model data if any model has moved since it was uploaded
+
+	if (model_revision_ != scene_->modelRevision())
+	{
+		uploadModelData();
+		model_revision_ = scene_->modelRevision();
+	}
+
+	// Learn which models' boxes were hidden in earlier frames
+
+	frame_index_++;
+	if (use_occlusion_culling_)
+	{
+		collectOcclusionResults();
+	}
+
 	// Calculate Aspect Ratio
 
 	GLint viewport_rect[4];
@@ -440,169 +1353,478 @@ windowViewRender(std::shared_ptr<tyga::Window> window)
 
 	// Calculate transformation to see Sponza
 
-	glm::mat4 projection = glm::perspective(scene_->camera().vertical_field_of_view_degrees, aspectRatio,
-								scene_->camera().near_plane_distance, scene_->camera().far_plane_distance);
-	glm::mat4 view = glm::lookAt(scene_->camera().position, scene_->camera().position + scene_->camera().direction, scene_->upDirection());
+	glm::mat4 projection = glm::perspective(camera.vertical_field_of_view_degrees, aspectRatio,
+								camera.near_plane_distance, camera.far_plane_distance);
+	glm::mat4 view = glm::lookAt(camera.position, camera.position + camera.direction, scene_->upDirection());
+
+	const glm::mat4 view_projection_xform = projection * view;
+
+	// World space frustum planes for model and cluster culling
+	glm::vec4 frustum_planes[6];
+	extractFrustumPlanes(view_projection_xform, frustum_planes);
+
+	// Pixels covered by one unit of length at unit distance, used to turn
+	// a LOD's geometric error into an on-screen error
+	const float pixels_per_unit = viewport_rect[3]
+		/ (2.0f * tanf(glm::radians(camera.vertical_field_of_view_degrees) * 0.5f));
 
 	// Set up the Shader Program
 
 	glUseProgram(sponza_shader_program_.program);
-	
-	// Apply uniforms for Ambient Intensity and the Camera Position
-	glUniform3fv(
-		glGetUniformLocation(sponza_shader_program_.program, "ambient_intensity"),
-		1, glm::value_ptr(scene_->ambientLightIntensity()));
-
-	glUniform3fv(
-			glGetUniformLocation(sponza_shader_program_.program, "camera_position"),
-			1, glm::value_ptr(scene_->camera().position));
-
-	glUniform1i(
-		glGetUniformLocation(sponza_shader_program_.program, "checkered"), 0);
-
-	// String locals for iterating through light source uniform data
-
-	std::string pos = "].position";
-	std::string ran = "].range";
-	std::string its = "].intensity";
-
-	for(int j = 0; j < scene_->lightCount(); j++)
-	{
-		std::string str = "lights[" + std::to_string(j);
-		std::string posStr = str + pos;
-
-		// Attach light position and range to uniform variables in light structure
-		glUniform3fv(
-			glGetUniformLocation(sponza_shader_program_.program, posStr.c_str()),// + "].position")),
-			1, glm::value_ptr(scene_->light(j).position));
-
-		std::string ranStr = str + ran;
-		GLfloat range = scene_->light(j).range;
-		GLfloat* p_range = &range;
-		glUniform1fv(
-			glGetUniformLocation(sponza_shader_program_.program, ranStr.c_str()),
-			1, p_range);
-
-		std::string itsStr = str + its;
-		glUniform3fv(
-			glGetUniformLocation(sponza_shader_program_.program, itsStr.c_str()),
-			1, glm::value_ptr(scene_->light(j).position));
-	}
-
-	// Apply model specific uniforms, such as the model and combined transforms,
-	// select the specular texture to use and draw the sponza models
-	for(unsigned int i = 0; i < scene_->modelCount(); i++)
-	{
-		// Get the model's transform
-		glm::mat4 model_xform = glm::mat4(scene_->model(i).xform);
-		
-		// Make the combined pipeline transformation
-		glm::mat4 combined_xform = projection * view * model_xform;
-
-		// Attach the two above variables and
-		// the model's material colour to the
-		// shader program
-		glUniformMatrix4fv(
-			glGetUniformLocation(sponza_shader_program_.program, "model_xform"),
-			1, GL_FALSE, glm::value_ptr(model_xform));
-
-		glUniformMatrix4fv(
-			glGetUniformLocation(sponza_shader_program_.program, "combined_xform"),
-			1, GL_FALSE, glm::value_ptr(combined_xform));
-
-		glUniform3fv(
-			glGetUniformLocation(sponza_shader_program_.program, "material_colour"),
-			1, glm::value_ptr(scene_->material(scene_->model(i).material_index).colour));
-
-		// Choose the specific texture needed
-		// for specular lighting
-		if(scene_->material(scene_->model(i).material_index).shininess_map == "shin1.png")
-		{
-			glUniform1i(
-				glGetUniformLocation(sponza_shader_program_.program, "specularOn"),
-				1);
 
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, shininess_textures_[0]);
-			glUniform1i(glGetUniformLocation(sponza_shader_program_.program, "shininess_texture"), 0);
+	glActiveTexture(GL_TEXTURE0 + kModelDataTextureUnit);
+	glBindTexture(GL_TEXTURE_BUFFER, model_data_texture_);
+	glActiveTexture(GL_TEXTURE0);
+
+	// Fill the per-frame uniform block and upload it in one call, which
+	// also orphans last frame's storage so the driver need not wait on it
+
+	FrameData frame_data;
+	frame_data.view_projection_xform = view_projection_xform;
+	frame_data.camera_position = camera.position;
+	frame_data.ambient_intensity = frame.ambient_light_intensity;
+	for(int j = 0; j < kMaxLights; j++)
+	{
+		// Unused entries are left dark with no range
+		if (j < (int)frame.lights.size())
+		{
+			const MyScene::Light& light = frame.lights[j];
+			frame_data.lights[j].position = light.position;
+			frame_data.lights[j].range = light.range;
+			frame_data.lights[j].intensity = light.intensity;
 		}
-		else if (scene_->material(scene_->model(i).material_index).shininess_map == "shin2.png")
+		else
 		{
-			glUniform1i(
-				glGetUniformLocation(sponza_shader_program_.program, "specularOn"),
-				1);
+			frame_data.lights[j].position = glm::vec3(0.0f, 0.0f, 0.0f);
+			frame_data.lights[j].range = 0.0f;
+			frame_data.lights[j].intensity = glm::vec3(0.0f, 0.0f, 0.0f);
+		}
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_data_ubo_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(frame_data), &frame_data, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// Queue every resident model, followed by the pyramids whose data
+	// comes after the scene's models, under a key of the state it needs.
+	// Texture and mesh slots are offset by one so zero means none. The
+	// coarse depth bucket orders each texture's draws front to back, so near
+	// geometry fills the depth buffer before what it hides is shaded.
+
+	const unsigned int pyramid_slot = meshes_.size() + 1;
+
+	// Cull the models down the scene's hierarchy, then place every
+	// bounding sphere in the world in one batch
+	size_t visible_count = 0;
+	if (!models.empty())
+	{
+		visible_count = scene_->modelHierarchy().cullFrustum(frustum_planes,
+															 &model_visible_[0]);
+		transformBoundingSpheres(&models[0].xform, sizeof(MyScene::Model),
+								 &model_local_spheres_[0], models.size(),
+								 &model_world_spheres_[0], &model_scales_[0],
+								 transform_pool_.get());
+	}
 
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, shininess_textures_[1]);
-			glUniform1i(glGetUniformLocation(sponza_shader_program_.program, "shininess_texture"), 0);
+	render_queue_.clear();
+	occluded_models_.clear();
+	for(unsigned int i = 0; i < models.size(); i++)
+	{
+		if (!model_visible_[i])
+			continue;
+
+		// Skip models whose mesh or shininess map has not streamed in yet
+		const MyScene::Model& model = models[i];
+		const Mesh& mesh = meshes_[model.mesh_index];
+		const Material& material = materials_[model.material_index];
+		if (mesh.pending_uploads > 0
+			|| (material.texture >= 0 && !textures_[material.texture].resident))
+			continue;
+
+		// Pick the level of detail from the model's projected size
+		const int lod_level = selectLod(i, mesh, model_world_spheres_[i],
+										model_scales_[i], camera.position,
+										camera.near_plane_distance,
+										pixels_per_unit);
+
+		// A model found hidden waits to be drawn conditionally on its
+		// newest query, even one still in flight, unless the camera is
+		// close enough for the near plane to clip its box
+		OcclusionQuery* occlusion = use_occlusion_culling_ ? &occlusion_queries_[i] : nullptr;
+		if (occlusion != nullptr && occlusion->hidden)
+		{
+			const glm::vec3 margin(camera.near_plane_distance);
+			if (glm::any(glm::lessThan(camera.position, model.bounds_min - margin))
+				|| glm::any(glm::greaterThan(camera.position, model.bounds_max + margin)))
+			{
+				occluded_models_.push_back(i);
+				continue;
+			}
+			occlusion->hidden = false;
 		}
-		else if (scene_->material(scene_->model(i).material_index).shininess_map == "shin3.png")
+
+		// Bucket by the distance to the nearest point of the bounding
+		// sphere, which the camera may be inside
+		const glm::vec4& sphere = model_world_spheres_[i];
+		const float distance = glm::distance(glm::vec3(sphere), camera.position) - sphere.w;
+		const unsigned int depth_bucket
+			= RenderQueue::depthBucket(distance, camera.near_plane_distance,
+									   camera.far_plane_distance);
+
+		render_queue_.push(RenderQueue::makeKey(0, material.texture + 1,
+												depth_bucket,
+												model.mesh_index + 1,
+												lod_level), i);
+	}
+
+	// Counted before the pyramids so it compares with the scene's models
+	render_statistics_.model_count = render_queue_.size();
+
+	if (pyramid_mesh_.pending_uploads == 0)
+	{
+		const glm::mat4 pyramid_xforms[2] = { big_model_xform, small_model_xform };
+		for (int p = 0; p < 2; p++)
 		{
-			glUniform1i(
-				glGetUniformLocation(sponza_shader_program_.program, "specularOn"),
-				1);
+			const float distance = glm::distance(glm::vec3(pyramid_xforms[p][3]),
+												 camera.position);
+			const unsigned int depth_bucket
+				= RenderQueue::depthBucket(distance, camera.near_plane_distance,
+										   camera.far_plane_distance);
+			render_queue_.push(RenderQueue::makeKey(0, 0, depth_bucket,
+													pyramid_slot, 0),
+							   models.size() + p);
+		}
+	}
+
+	render_statistics_.culled_count = models.size() - visible_count;
+	render_statistics_.occluded_count = occluded_models_.size();
+	render_statistics_.unsorted_state_changes = countStateChanges(render_queue_);
+	render_queue_.sort();
+	render_statistics_.sorted_state_changes = countStateChanges(render_queue_);
+
+	// Upload the sorted model indices, which each draw reads its
+	// instances from, followed by the hidden models'
+
+	instance_models_.resize(render_queue_.size() + occluded_models_.size());
+	for(size_t q = 0; q < render_queue_.size(); q++)
+	{
+		instance_models_[q] = render_queue_.item(q);
+	}
+	for(size_t k = 0; k < occluded_models_.size(); k++)
+	{
+		instance_models_[render_queue_.size() + k] = occluded_models_[k];
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, instance_models_.size() * sizeof(GLint),
+				 instance_models_.empty() ? nullptr : &instance_models_[0],
+				 GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Build the frame's command list in key order. Each run of models that
+	// share a mesh, material and level of detail is a single instanced
+	// command whose base instance is the run's first entry.
 
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, shininess_textures_[2]);
-			glUniform1i(glGetUniformLocation(sponza_shader_program_.program, "shininess_texture"), 0);
+	draw_commands_.clear();
+	draw_batches_.clear();
+	for(size_t first = 0; first < render_queue_.size();)
+	{
+		const uint64_t key = render_queue_.key(first);
+		size_t last = first + 1;
+		while (use_instancing_ && last < render_queue_.size()
+			   && RenderQueue::sameBatch(render_queue_.key(last), key))
+			last++;
+
+		const unsigned int texture = RenderQueue::keyTexture(key);
+		const unsigned int mesh_slot = RenderQueue::keyMesh(key);
+		const Mesh& mesh = mesh_slot == pyramid_slot
+						   ? pyramid_mesh_ : meshes_[mesh_slot - 1];
+		const int lod_level = RenderQueue::keyLod(key);
+		const MyScene::Lod& lod = mesh.lods[lod_level];
+		const size_t element_size = mesh.element_type == GL_UNSIGNED_SHORT
+									? sizeof(GLushort) : sizeof(GLuint);
+
+		// A lone model at full detail is culled cluster by cluster where
+		// clusters were built, which instances cannot share
+		if (last - first == 1 && lod_level == 0 && !mesh.clusters.empty())
+		{
+			pushClusterCommands(texture, mesh, first,
+								glm::mat4(models[render_queue_.item(first)].xform),
+								camera.position, frustum_planes);
 		}
 		else
 		{
-			glUniform1i(
-				glGetUniformLocation(sponza_shader_program_.program, "specularOn"),
-				0);
+			DrawCommand command;
+			command.element_count = lod.element_count;
+			command.instance_count = last - first;
+			command.first_element = mesh.element_offset / element_size
+									+ lod.first_element;
+			command.base_vertex = mesh.base_vertex;
+			command.base_instance = first;
+			pushDrawCommand(texture, mesh.element_type, command);
 		}
+		first = last;
+	}
+
+	// Submit the command list, once for depth alone first when the
+	// pre-pass is on
+
+	glBindVertexArray(vao_);
 
-		// Bind the vertex array and draw the model
-		glBindVertexArray(meshes_[scene_->model(i).mesh_index].vao);
-		glDrawElements(GL_TRIANGLES, meshes_[scene_->model(i).mesh_index].element_count, GL_UNSIGNED_INT, 0);
+	if (use_multi_draw_indirect_)
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_command_buffer_);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, draw_commands_.size() * sizeof(DrawCommand),
+					 draw_commands_.empty() ? nullptr : &draw_commands_[0],
+					 GL_STREAM_DRAW);
+	}
+	else
+	{
+		// The fallback moves the model index attribute to each draw's
+		// base instance itself
+		glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
 	}
 
-	// Drawing the Pyramids
+	beginGpuTimer();
 
-	// Set the uniform boolean to make the pyramids checkered
-	glUniform1i(
-		glGetUniformLocation(sponza_shader_program_.program, "checkered"), 1);
+	int submission_count = 0;
+	if (use_depth_prepass_)
+	{
+		// Lay down the nearest depth with a trivial program, so the main
+		// pass only shades the fragments that end up visible
+		glUseProgram(depth_shader_program_.program);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		submission_count += submitDrawCommands(false);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		glUseProgram(sponza_shader_program_.program);
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+	}
+	submission_count += submitDrawCommands(true);
+	if (use_depth_prepass_)
+	{
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
 
-	// Big Pyramid
-	glm::mat4 model_xform = big_model_xform;
-		
-	glm::mat4 combined_xform = projection * view * model_xform;
+	if (use_multi_draw_indirect_)
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	else
+	{
+		glVertexAttribIPointer(kModelIndexAttribute, 1, GL_INT, 0, TGL_BUFFER_OFFSET(0));
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	render_statistics_.draw_count = draw_commands_.size();
+	render_statistics_.submission_count = submission_count;
+	render_statistics_.occlusion_query_count = 0;
+
+	// With the queued models' depth in place, test every box against it
+
+	if (use_occlusion_culling_)
+	{
+		renderOccludedModels(render_queue_.size());
+	}
+
+	endGpuTimer();
+	render_statistics_.forward_gpu_time_ms = gpu_time_ms_[0];
+	render_statistics_.depth_prepass_gpu_time_ms = gpu_time_ms_[1];
+}
+
+int MyView::
+submitDrawCommands(bool bind_textures)
+{
+	// Textures are bound only when they differ from the previous batch's
+	unsigned int bound_texture = 0;
+	int submission_count = 0;
+	for (const auto& batch : draw_batches_)
+	{
+		if (bind_textures && batch.texture != 0 && batch.texture != bound_texture)
+		{
+			glBindTexture(GL_TEXTURE_2D, textures_[batch.texture - 1].id);
+			bound_texture = batch.texture;
+		}
+
+		if (use_multi_draw_indirect_)
+		{
+			glMultiDrawElementsIndirect(GL_TRIANGLES, batch.element_type,
+										TGL_BUFFER_OFFSET(batch.first_command
+														  * sizeof(DrawCommand)),
+										batch.command_count, 0);
+			submission_count++;
+		}
+		else
+		{
+			submission_count += submitDrawBatch(batch);
+		}
+	}
+	return submission_count;
+}
+
+void MyView::
+beginGpuTimer()
+{
+	// Read whichever earlier frames' times have arrived
+	for (int t = 0; t < kGpuTimerCount; t++)
+	{
+		GpuTimer& timer = gpu_timers_[t];
+		if (!timer.pending)
+			continue;
+
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(timer.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available == GL_FALSE)
+			continue;
+
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(timer.query, GL_QUERY_RESULT, &nanoseconds);
+		const float milliseconds = nanoseconds * 1e-6f;
+		float& average = gpu_time_ms_[timer.depth_prepass ? 1 : 0];
+		average = average == 0.0f ? milliseconds
+								  : average + (milliseconds - average) * kGpuTimeSmoothing;
+		timer.pending = false;
+	}
 
-	glUniformMatrix4fv(
-		glGetUniformLocation(sponza_shader_program_.program, "model_xform"),
-		1, GL_FALSE, glm::value_ptr(model_xform));
+	// Skip timing this frame rather than wait if every timer is in flight
+	active_gpu_timer_ = -1;
+	for (int t = 0; t < kGpuTimerCount; t++)
+	{
+		if (gpu_timers_[t].query != 0 && !gpu_timers_[t].pending)
+		{
+			active_gpu_timer_ = t;
+			glBeginQuery(GL_TIME_ELAPSED, gpu_timers_[t].query);
+			break;
+		}
+	}
+}
 
-	glUniformMatrix4fv(
-		glGetUniformLocation(sponza_shader_program_.program, "combined_xform"),
-		1, GL_FALSE, glm::value_ptr(combined_xform));
+void MyView::
+endGpuTimer()
+{
+	if (active_gpu_timer_ < 0)
+		return;
+
+	glEndQuery(GL_TIME_ELAPSED);
+	GpuTimer& timer = gpu_timers_[active_gpu_timer_];
+	timer.pending = true;
+	timer.depth_prepass = use_depth_prepass_;
+	active_gpu_timer_ = -1;
+}
 
-	glUniform3fv(
-		glGetUniformLocation(sponza_shader_program_.program, "material_colour"),
-		1, glm::value_ptr(glm::vec3(1.0, 1.0, 1.0)));
+void MyView::
+collectOcclusionResults()
+{
+	unsigned int latency_total = 0;
+	int result_count = 0;
+	for (auto& occlusion : occlusion_queries_)
+	{
+		if (!occlusion.pending)
+			continue;
+
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(occlusion.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available == GL_FALSE)
+			continue;
+
+		GLuint any_samples_passed = GL_FALSE;
+		glGetQueryObjectuiv(occlusion.query, GL_QUERY_RESULT, &any_samples_passed);
+		occlusion.hidden = any_samples_passed == GL_FALSE;
+		occlusion.pending = false;
+		latency_total += frame_index_ - occlusion.issue_frame;
+		result_count++;
+	}
+	render_statistics_.occlusion_query_latency
+		= result_count > 0 ? latency_total / (float)result_count : 0.0f;
+}
 
-	glUniform1i(
-				glGetUniformLocation(sponza_shader_program_.program, "specularOn"),
-				0);
+void MyView::
+renderOccludedModels(size_t first_instance)
+{
+	const std::vector<MyScene::Model>& models = scene_->models();
 
-	// Draw the big pyramid
-	glBindVertexArray(pyramid_mesh_.vao);
-	glDrawElements(GL_TRIANGLES, pyramid_mesh_.element_count, GL_UNSIGNED_INT, 0);
+	// Boxes only test depth, and both their faces are drawn in case the
+	// camera is inside one
 
-	// Small Pyramid
-	model_xform = small_model_xform;
-		
-	combined_xform = projection * view * model_xform;
+	glUseProgram(occlusion_shader_program_.program);
+	glBindVertexArray(occlusion_box_vao_);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glDisable(GL_CULL_FACE);
 
-	glUniformMatrix4fv(
-		glGetUniformLocation(sponza_shader_program_.program, "model_xform"),
-		1, GL_FALSE, glm::value_ptr(model_xform));
+	int query_count = 0;
+	auto queryBox = [&](unsigned int model_index)
+	{
+		OcclusionQuery& occlusion = occlusion_queries_[model_index];
+		const MyScene::Model& model = models[model_index];
+		glUniform3fv(occlusion_shader_program_.uniforms.box_min, 1,
+					 glm::value_ptr(model.bounds_min));
+		glUniform3fv(occlusion_shader_program_.uniforms.box_max, 1,
+					 glm::value_ptr(model.bounds_max));
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, occlusion.query);
+		glDrawElements(GL_TRIANGLES, sizeof(kBoxElements), GL_UNSIGNED_BYTE,
+					   TGL_BUFFER_OFFSET(0));
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+		occlusion.pending = true;
+		occlusion.issue_frame = frame_index_;
+		query_count++;
+	};
+
+	// Models are only queried again once their last result is in, so a
+	// result is never discarded unread and hidden models stay hidden
+	// until one says otherwise
+	for (size_t q = 0; q < render_queue_.size(); q++)
+	{
+		const unsigned int i = render_queue_.item(q);
+		if (i < models.size() && !occlusion_queries_[i].pending)
+			queryBox(i);
+	}
+	for (unsigned int i : occluded_models_)
+	{
+		if (!occlusion_queries_[i].pending)
+			queryBox(i);
+	}
 
-	glUniformMatrix4fv(
-		glGetUniformLocation(sponza_shader_program_.program, "combined_xform"),
-		1, GL_FALSE, glm::value_ptr(combined_xform));
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glEnable(GL_CULL_FACE);
+
+	// Each hidden model is drawn at its chosen level of detail only if the
+	// GPU finds its newest query passed; the CPU never waits for the
+	// answer. A query from an earlier frame may hold a model back for as
+	// many frames as results are late.
+
+	glUseProgram(sponza_shader_program_.program);
+	glBindVertexArray(vao_);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
+	for (size_t k = 0; k < occluded_models_.size(); k++)
+	{
+		const unsigned int i = occluded_models_[k];
+		const MyScene::Model& model = models[i];
+		const Mesh& mesh = meshes_[model.mesh_index];
+		const Material& material = materials_[model.material_index];
+		const MyScene::Lod& lod = mesh.lods[model_lod_[i]];
+		const size_t element_size = mesh.element_type == GL_UNSIGNED_SHORT
+									? sizeof(GLushort) : sizeof(GLuint);
+
+		if (material.texture >= 0)
+			glBindTexture(GL_TEXTURE_2D, textures_[material.texture].id);
+		glVertexAttribIPointer(kModelIndexAttribute, 1, GL_INT, 0,
+							   TGL_BUFFER_OFFSET((first_instance + k) * sizeof(GLint)));
+
+		glBeginConditionalRender(occlusion_queries_[i].query, GL_QUERY_WAIT);
+		glDrawElementsBaseVertex(GL_TRIANGLES, lod.element_count, mesh.element_type,
+								 TGL_BUFFER_OFFSET(mesh.element_offset
+												   + lod.first_element * element_size),
+								 mesh.base_vertex);
+		glEndConditionalRender();
+	}
+	glVertexAttribIPointer(kModelIndexAttribute, 1, GL_INT, 0, TGL_BUFFER_OFFSET(0));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	// Draw the small pyramid
-	glBindVertexArray(pyramid_mesh_.vao);
-	glDrawElements(GL_TRIANGLES, pyramid_mesh_.element_count, GL_UNSIGNED_INT, 0);
+	// Conditional draws are issued whether or not the GPU then skips them
+	render_statistics_.draw_count += occluded_models_.size();
+	render_statistics_.submission_count += occluded_models_.size();
+	render_statistics_.occlusion_query_count = query_count;
 }
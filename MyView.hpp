@@ -2,12 +2,14 @@
 
 #include "WindowViewDelegate.hpp"
 #include "tgl.h"
+#include "MyScene.hpp"
+#include "RenderQueue.hpp"
+#include "ThreadPool.hpp"
 #include <glm/glm.hpp>
 #include <vector>
+#include <deque>
 #include <memory>
 
-class MyScene;
-
 class MyView : public tyga::WindowViewDelegate
 {
 public:
@@ -19,6 +21,108 @@ public:
     void
     setScene(std::shared_ptr<const MyScene> scene);
 
+    /**
+     Selects the quantised 16 byte vertex format and 16-bit elements where
+     they fit. Must be called before the view starts.
+     */
+    void
+    setUseCompactVertices(bool yes);
+
+    /**
+     Draws consecutive models that share a mesh, material and level of
+     detail with a single instanced draw. On by default.
+     */
+    void
+    setUseInstancing(bool yes);
+
+    /**
+     Submits the frame's command list with glMultiDrawElementsIndirect
+     where the context supports it and nonzero base instances, otherwise
+     draw by draw. On by default; must be called before the view starts.
+     */
+    void
+    setUseMultiDrawIndirect(bool yes);
+
+    /**
+     Streams mesh buffers and textures to the GPU across frames, spending
+     at most bytes_per_frame each frame so the window shows straight away.
+     Zero uploads everything before the first frame.
+     */
+    void
+    setUploadBudget(size_t bytes_per_frame);
+
+    /**
+     Routes the view's GL state changes through tgl's state cache, which
+     drops redundant calls and counts them. On by default; must be called
+     before the view starts.
+     */
+    void
+    setUseStateCache(bool yes);
+
+    /**
+     Skips models whose bounding boxes were last found hidden behind the
+     rest of the scene. Such models are drawn under conditional render on
+     their newest query, re-queried against this frame's depth whenever
+     the last query has been answered, so they reappear without the CPU
+     waiting on the GPU. Off by default.
+     */
+    void
+    setUseOcclusionCulling(bool yes);
+
+    /**
+     Draws the frame's depth alone first with a trivial program, then
+     shades only the fragments whose depth equals it, so overdrawn
+     fragments skip the lighting. Off by default.
+     */
+    void
+    setUseDepthPrepass(bool yes);
+
+    /**
+     Counts describing the most recently rendered frame.
+     */
+    struct RenderStatistics
+    {
+        // scene models queued for drawing; the two pyramids are not
+        // counted, so with culled_count and occluded_count this adds up
+        // to MyScene::modelCount() less any not yet streamed in
+        int model_count;
+        // models outside the view frustum, which are not queued
+        int culled_count;
+        // draws of the scene models and the pyramids, including the
+        // conditional draws of occluded models
+        int draw_count;
+        // draw calls made to submit the draws
+        int submission_count;
+        // binds needed in scene order and in sorted order
+        int unsorted_state_changes;
+        int sorted_state_changes;
+        // models hidden last frame, drawn only if their query passes
+        int occluded_count;
+        int occlusion_query_count;
+        // mean frames from issuing a query to its result being read, over
+        // the results read this frame
+        float occlusion_query_latency;
+        // GPU milliseconds to draw the scene without and with the depth
+        // pre-pass, averaged over recent frames; zero until measured
+        float forward_gpu_time_ms;
+        float depth_prepass_gpu_time_ms;
+
+        RenderStatistics() : model_count(0),
+                             culled_count(0),
+                             draw_count(0),
+                             submission_count(0),
+                             unsorted_state_changes(0),
+                             sorted_state_changes(0),
+                             occluded_count(0),
+                             occlusion_query_count(0),
+                             occlusion_query_latency(0.f),
+                             forward_gpu_time_ms(0.f),
+                             depth_prepass_gpu_time_ms(0.f) {}
+    };
+
+    RenderStatistics
+    renderStatistics() const;
+
 private:
 
     void
@@ -37,19 +141,83 @@ private:
 
     std::shared_ptr<const MyScene> scene_;
 
-	GLuint shininess_textures_[3];
+    struct Texture
+    {
+        GLuint id;
+        bool resident;
+
+        Texture() : id(0),
+                    resident(false) {}
+    };
+    std::vector<Texture> textures_;
+
+    /**
+     A scene material resolved to the slots the draw loop needs.
+     */
+    struct Material
+    {
+        glm::vec3 colour;
+        int texture;
+    };
+    std::vector<Material> materials_;
+
+    enum { kMaxLights = 7 }; // size of the lights array in the shaders
+
+    /**
+     Mirrors the std140 FrameData uniform block in the sponza shaders.
+     */
+    struct FrameData
+    {
+        glm::mat4 view_projection_xform;
+        glm::vec3 camera_position;
+        float padding0;
+        glm::vec3 ambient_intensity;
+        float padding1;
+        struct Light
+        {
+            glm::vec3 position;
+            float range;
+            glm::vec3 intensity;
+            float padding;
+        } lights[kMaxLights];
+    };
+    GLuint frame_data_ubo_;
+
+    /**
+     Uniform locations of a program, looked up once after link, and -1
+     where the program lacks one.
+     The per-frame uniforms live in the FrameData block and the per-model
+     ones in the model data buffer instead.
+     */
+    struct UniformLocations
+    {
+        GLint model_data;
+        GLint shininess_texture;
+        // occlusion program only
+        GLint box_min;
+        GLint box_max;
+    };
 
     struct ShaderProgram
     {
         GLuint vertex_shader;
         GLuint fragment_shader;
         GLuint program;
+        UniformLocations uniforms;
 
         ShaderProgram() : vertex_shader(0),
                           fragment_shader(0),
                           program(0) {}
+
+        /**
+         Looks up the uniform locations and binds the FrameData block.
+         */
+        void
+        resolveUniformLocations();
     };
 	ShaderProgram sponza_shader_program_;
+	ShaderProgram occlusion_shader_program_;
+	ShaderProgram depth_shader_program_;
 
     struct Vertex
     {
@@ -58,19 +226,339 @@ private:
 		glm::vec2 texCoord;
     };
 
+    struct CompactVertex
+    {
+        GLushort position[4];
+        GLshort normal[2];
+        GLushort texCoord[2];
+    };
+
+    static void
+    compactVertices(const std::vector<MyScene::Vertex>& vertices,
+                    std::vector<CompactVertex>& compact_vertices,
+                    glm::vec3& position_scale,
+                    glm::vec3& position_bias);
+
+    bool use_compact_vertices_;
+
+    /**
+     A mesh's ranges of the shared vertex and element buffers. Its
+     elements index from base_vertex and start element_offset bytes in.
+     */
     struct Mesh
     {
-        GLuint vertex_vbo;
-        GLuint element_vbo;
-        GLuint vao;
+        GLint base_vertex;
+        size_t element_offset;
         int element_count;
+        GLenum element_type;
+        bool compact;
+        glm::vec3 position_scale;
+        glm::vec3 position_bias;
+        std::vector<MyScene::Lod> lods;
+        std::vector<MyScene::Cluster> clusters;
+        glm::vec3 bounds_centre;
+        float bounds_radius;
+        int pending_uploads;
 
-        Mesh() : vertex_vbo(0),
-                 element_vbo(0),
-                 vao(0),
-                 element_count(0) {}
+        Mesh() : base_vertex(0),
+                 element_offset(0),
+                 element_count(0),
+                 element_type(GL_UNSIGNED_INT),
+                 compact(false),
+                 position_scale(1.f, 1.f, 1.f),
+                 position_bias(0.f, 0.f, 0.f),
+                 bounds_centre(0.f, 0.f, 0.f),
+                 bounds_radius(0.f),
+                 pending_uploads(0) {}
     };
 	std::vector<Mesh> meshes_;
 	Mesh pyramid_mesh_;
+
+    // Every mesh, the pyramid included, lives in these buffers
+    GLuint vertex_vbo_;
+    GLuint element_vbo_;
+    GLuint vao_;
 	glm::mat4x4 big_model_xform, small_model_xform;
+
+    /**
+     Everything the shaders need to draw one model, stored as consecutive
+     RGBA32F texels of a texture buffer and fetched by model_index. The
+     scene's models come first, followed by the big and small pyramids.
+     */
+    struct ModelData
+    {
+        glm::vec4 xform_rows[3];
+        glm::vec4 colour_specular;
+        glm::vec4 scale_compact;
+        glm::vec4 bias_checkered;
+    };
+    GLuint model_data_tbo_;
+    GLuint model_data_texture_;
+
+    // Model indices of every queued draw in submission order, read by the
+    // vertex shader as a per-instance attribute from each draw's base
+    // instance onwards
+    std::vector<GLint> instance_models_;
+    GLuint instance_vbo_;
+    bool use_instancing_;
+
+    /**
+     Matches the layout of GL's DrawElementsIndirectCommand.
+     */
+    struct DrawCommand
+    {
+        GLuint element_count;
+        GLuint instance_count;
+        GLuint first_element;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    /**
+     Consecutive commands that can be submitted together because they
+     share a texture and element type.
+     */
+    struct DrawBatch
+    {
+        unsigned int texture;
+        GLenum element_type;
+        size_t first_command;
+        size_t command_count;
+    };
+
+    std::vector<DrawCommand> draw_commands_;
+    std::vector<DrawBatch> draw_batches_;
+    GLuint draw_command_buffer_;
+    bool use_multi_draw_indirect_;
+
+    /**
+     Appends a command, opening a new batch if its state differs from the
+     last command's.
+     */
+    void
+    pushDrawCommand(unsigned int texture,
+                    GLenum element_type,
+                    const DrawCommand& command);
+
+    /**
+     Issues the command list one draw at a time, for contexts without
+     multi-draw indirect.
+     @return  Number of draw calls made.
+     */
+    int
+    submitDrawBatch(const DrawBatch& batch);
+
+    /**
+     Submits every batch of the command list with the current program.
+     @return  Number of draw calls made.
+     */
+    int
+    submitDrawCommands(bool bind_textures);
+
+    /**
+     Packs every model's transform, material and vertex decoding into the
+     model data buffer. Repeated whenever the scene's models move.
+     */
+    void
+    uploadModelData();
+
+    int
+    selectLod(unsigned int model_index,
+              const Mesh& mesh,
+              const glm::vec4& world_sphere,
+              float scale,
+              glm::vec3 camera_position,
+              float near_plane_distance,
+              float pixels_per_unit);
+
+    /**
+     Appends a command per range of the mesh's clusters that is inside the
+     frustum and not facing wholly away from the camera.
+     */
+    void
+    pushClusterCommands(unsigned int texture,
+                        const Mesh& mesh,
+                        GLuint instance,
+                        const glm::mat4& model_xform,
+                        glm::vec3 camera_position,
+                        const glm::vec4 frustum_planes[6]);
+
+    /**
+     A buffer's contents or a texture still waiting to reach the
+     GPU. Buffer data is uploaded in budget sized pieces.
+     */
+    struct PendingUpload
+    {
+        Mesh* mesh;
+        GLuint buffer;
+        size_t buffer_offset;
+        const char* data;
+        size_t size;
+        size_t uploaded;
+        std::vector<char> storage;
+        int texture_index;
+
+        PendingUpload() : mesh(nullptr),
+                          buffer(0),
+                          buffer_offset(0),
+                          data(nullptr),
+                          size(0),
+                          uploaded(0),
+                          texture_index(-1) {}
+    };
+    std::deque<PendingUpload> pending_uploads_;
+    size_t upload_budget_;
+    size_t bytes_streamed_;
+    int streaming_frames_;
+    bool first_frame_rendered_;
+    bool startup_reported_;
+
+    /**
+     Queues data for upload to a range of the buffer.
+     @param copy  Whether data must be copied because it will not outlive
+                  the upload.
+     */
+    void
+    queueBufferUpload(Mesh& mesh,
+                      GLuint buffer,
+                      size_t buffer_offset,
+                      const void* data,
+                      size_t size,
+                      bool copy);
+
+    /**
+     Places the mesh at the end of the shared buffers, growing their sizes,
+     and queues its vertices, converted to the view's vertex format, and
+     its elements for upload.
+     @param persistent  Whether vertices and elements outlive the upload,
+                        so need not be copied.
+     */
+    void
+    queueMeshUpload(Mesh& mesh,
+                    const std::vector<MyScene::Vertex>& vertices,
+                    const std::vector<unsigned int>& elements,
+                    size_t& vertex_buffer_size,
+                    size_t& element_buffer_size,
+                    bool persistent);
+
+    /**
+     Uploads queued work until byte_budget is spent. A texture is decoded
+     and uploaded whole so may overrun the budget.
+     */
+    void
+    streamUploads(size_t byte_budget);
+
+    /**
+     Decodes the scene texture's PNG and uploads it with mipmaps.
+     @return  Number of bytes uploaded.
+     */
+    size_t
+    uploadTexture(int index);
+
+    // Scratch ranges for drawing a batch's single instance commands
+    // together when multi-draw indirect is unavailable
+    std::vector<GLsizei> cluster_counts_;
+    std::vector<const GLvoid*> cluster_offsets_;
+    std::vector<GLint> cluster_base_vertices_;
+
+    RenderQueue render_queue_;
+    RenderStatistics render_statistics_;
+
+    // Largest on-screen error in pixels a LOD may introduce
+    float lod_pixel_error_;
+    std::vector<int> model_lod_;
+
+    // Each model's mesh bounding sphere in its own and in world space,
+    // with the transform's largest axis scale, refreshed in one batch
+    // every frame
+    std::vector<glm::vec4> model_local_spheres_;
+    std::vector<glm::vec4> model_world_spheres_;
+    std::vector<float> model_scales_;
+    // Only created for scenes large enough to be worth splitting
+    std::unique_ptr<ThreadPool> transform_pool_;
+
+    // Whether each model was inside the frustum this frame
+    std::vector<unsigned char> model_visible_;
+
+    bool use_state_cache_;
+
+    // The scene's model revision when the model data was last uploaded
+    unsigned int model_revision_;
+
+    /**
+     A model's occlusion query and what its last result said. A hidden
+     model stays hidden while a newer query is in flight, being drawn
+     conditionally on that query until its result is read.
+     */
+    struct OcclusionQuery
+    {
+        GLuint query;
+        unsigned int issue_frame;
+        bool pending;
+        bool hidden;
+
+        OcclusionQuery() : query(0),
+                           issue_frame(0),
+                           pending(false),
+                           hidden(false) {}
+    };
+    std::vector<OcclusionQuery> occlusion_queries_;
+    // Models skipped from this frame's queue as hidden
+    std::vector<unsigned int> occluded_models_;
+    bool use_occlusion_culling_;
+    unsigned int frame_index_;
+
+    // A unit cube drawn stretched over each model's box
+    GLuint occlusion_box_vbo_;
+    GLuint occlusion_box_ebo_;
+    GLuint occlusion_box_vao_;
+
+    /**
+     Reads the results of queries that have finished, without waiting on
+     those that have not.
+     */
+    void
+    collectOcclusionResults();
+
+    /**
+     Queries the boxes of the queued and hidden models with no query in
+     flight against the depth of the queued ones, then draws the hidden
+     models conditionally on their newest queries. Model indices of the
+     hidden models follow the queue's in the instance buffer, from
+     first_instance.
+     */
+    void
+    renderOccludedModels(size_t first_instance);
+
+    bool use_depth_prepass_;
+
+    /**
+     A GL_TIME_ELAPSED query around one frame's drawing, and which
+     configuration that frame used.
+     */
+    struct GpuTimer
+    {
+        GLuint query;
+        bool pending;
+        bool depth_prepass;
+
+        GpuTimer() : query(0),
+                     pending(false),
+                     depth_prepass(false) {}
+    };
+    enum { kGpuTimerCount = 4 };
+    GpuTimer gpu_timers_[kGpuTimerCount];
+    int active_gpu_timer_;
+    // Running average per configuration, without and with the pre-pass
+    float gpu_time_ms_[2];
+
+    /**
+     Reads back finished timers, then starts timing this frame's drawing
+     if a timer is free.
+     */
+    void
+    beginGpuTimer();
+
+    void
+    endGpuTimer();
 };
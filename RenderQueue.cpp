@@ -0,0 +1,138 @@
+#include "RenderQueue.hpp"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+uint64_t RenderQueue::
+makeKey(unsigned int program,
+        unsigned int texture,
+        unsigned int depth_bucket,
+        unsigned int mesh,
+        unsigned int lod)
+{
+    return ((uint64_t)(program & 0xff) << 56)
+         | ((uint64_t)(texture & 0xfff) << 44)
+         | ((uint64_t)(depth_bucket & 0x3f) << 38)
+         | ((uint64_t)(mesh & 0xfffff) << 18)
+         | ((uint64_t)(lod & 0xff) << 10);
+}
+
+bool RenderQueue::
+sameBatch(uint64_t key_a,
+          uint64_t key_b)
+{
+    const uint64_t depth_mask = (uint64_t)0x3f << 38;
+    return (key_a & ~depth_mask) == (key_b & ~depth_mask);
+}
+
+unsigned int RenderQueue::
+depthBucket(float distance,
+            float near_distance,
+            float far_distance)
+{
+    if (distance <= near_distance) {
+        return 0;
+    }
+    if (distance >= far_distance) {
+        return kDepthBucketCount - 1;
+    }
+    const float t = logf(distance / near_distance)
+                  / logf(far_distance / near_distance);
+    return std::min((unsigned int)(t * kDepthBucketCount),
+                    (unsigned int)kDepthBucketCount - 1);
+}
+
+unsigned int RenderQueue::
+keyProgram(uint64_t key)
+{
+    return (unsigned int)(key >> 56) & 0xff;
+}
+
+unsigned int RenderQueue::
+keyTexture(uint64_t key)
+{
+    return (unsigned int)(key >> 44) & 0xfff;
+}
+
+unsigned int RenderQueue::
+keyMesh(uint64_t key)
+{
+    return (unsigned int)(key >> 18) & 0xfffff;
+}
+
+unsigned int RenderQueue::
+keyDepthBucket(uint64_t key)
+{
+    return (unsigned int)(key >> 38) & 0x3f;
+}
+
+unsigned int RenderQueue::
+keyLod(uint64_t key)
+{
+    return (unsigned int)(key >> 10) & 0xff;
+}
+
+void RenderQueue::
+clear()
+{
+    entries_.clear();
+}
+
+void RenderQueue::
+push(uint64_t key,
+     unsigned int item)
+{
+    Entry entry;
+    entry.key = key;
+    entry.item = item;
+    entries_.push_back(entry);
+}
+
+void RenderQueue::
+sort()
+{
+    if (entries_.size() < 2) {
+        return;
+    }
+    scratch_.resize(entries_.size());
+
+    for (int shift=0; shift<64; shift+=8) {
+        size_t counts[256];
+        memset(counts, 0, sizeof(counts));
+        for (const auto& entry : entries_) {
+            ++counts[(entry.key >> shift) & 0xff];
+        }
+        if (counts[(entries_[0].key >> shift) & 0xff] == entries_.size()) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int digit=0; digit<256; ++digit) {
+            const size_t count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
+        for (const auto& entry : entries_) {
+            scratch_[counts[(entry.key >> shift) & 0xff]++] = entry;
+        }
+        entries_.swap(scratch_);
+    }
+}
+
+size_t RenderQueue::
+size() const
+{
+    return entries_.size();
+}
+
+uint64_t RenderQueue::
+key(size_t index) const
+{
+    return entries_[index].key;
+}
+
+unsigned int RenderQueue::
+item(size_t index) const
+{
+    return entries_[index].item;
+}
@@ -0,0 +1,102 @@
+/*
+ @file      RenderQueue.hpp
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ Draw items ordered by 64-bit keys of the state they need, so that items
+ sharing a program and texture are submitted together and roughly front
+ to back, with draws of the same mesh next to each other.
+ */
+class RenderQueue
+{
+public:
+
+    enum { kDepthBucketCount = 64 };
+
+    /**
+     Packs slot numbers, not GL names, most significant first: program in
+     8 bits, texture in 12, depth bucket in 6, mesh in 20 and level of
+     detail in 8. The coarse depth orders a texture's draws front to back
+     while leaving the draws of a mesh within one bucket together.
+     */
+    static uint64_t
+    makeKey(unsigned int program,
+            unsigned int texture,
+            unsigned int depth_bucket,
+            unsigned int mesh,
+            unsigned int lod);
+
+    /**
+     Whether two keys need the same state and geometry, differing at most
+     in depth, so their items can be drawn as instances of one draw.
+     */
+    static bool
+    sameBatch(uint64_t key_a,
+              uint64_t key_b);
+
+    /**
+     Quantises a distance from the camera to one of kDepthBucketCount
+     buckets, spaced logarithmically between the near and far planes so
+     buckets are finest close to the camera, as the depth buffer's
+     precision is.
+     */
+    static unsigned int
+    depthBucket(float distance,
+                float near_distance,
+                float far_distance);
+
+    static unsigned int
+    keyProgram(uint64_t key);
+
+    static unsigned int
+    keyTexture(uint64_t key);
+
+    static unsigned int
+    keyMesh(uint64_t key);
+
+    static unsigned int
+    keyDepthBucket(uint64_t key);
+
+    static unsigned int
+    keyLod(uint64_t key);
+
+    void
+    clear();
+
+    void
+    push(uint64_t key,
+         unsigned int item);
+
+    /**
+     Stable LSD radix sort by key, a byte per pass, skipping any byte
+     that every key shares.
+     */
+    void
+    sort();
+
+    size_t
+    size() const;
+
+    uint64_t
+    key(size_t index) const;
+
+    unsigned int
+    item(size_t index) const;
+
+private:
+
+    struct Entry
+    {
+        uint64_t key;
+        unsigned int item;
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<Entry> scratch_;
+};
@@ -0,0 +1,127 @@
+#include "StartupProfile.hpp"
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+StartupProfile& StartupProfile::
+instance()
+{
+    // first used on the main thread before any workers start
+    static StartupProfile profile;
+    return profile;
+}
+
+StartupProfile::
+StartupProfile() : start_time_(std::chrono::high_resolution_clock::now())
+{
+}
+
+double StartupProfile::
+elapsed() const
+{
+    const auto duration = std::chrono::high_resolution_clock::now()
+                        - start_time_;
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+           .count() * 1e-6;
+}
+
+void StartupProfile::
+addPhase(const std::string& name,
+         double start_seconds,
+         double duration_seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& phase : phases_) {
+        if (phase.name == name) {
+            phase.duration += duration_seconds;
+            ++phase.count;
+            return;
+        }
+    }
+    Phase phase;
+    phase.name = name;
+    phase.start = start_seconds;
+    phase.duration = duration_seconds;
+    phase.count = 1;
+    phases_.push_back(phase);
+}
+
+void StartupProfile::
+mark(const std::string& name)
+{
+    addPhase(name, elapsed(), 0.0);
+}
+
+bool StartupProfile::
+writeJson(std::string filepath) const
+{
+    std::ofstream file(filepath);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    file << std::fixed << std::setprecision(3);
+    file << "{\n  \"phases\": [";
+    for (size_t i=0; i<phases_.size(); ++i) {
+        // phase names are identifiers so need no escaping
+        file << (i > 0 ? "," : "") << "\n    { \"name\": \""
+             << phases_[i].name << "\", \"start_ms\": "
+             << phases_[i].start * 1000.0 << ", \"duration_ms\": "
+             << phases_[i].duration * 1000.0 << ", \"count\": "
+             << phases_[i].count << " }";
+    }
+    file << "\n  ]\n}\n";
+    return file.good();
+}
+
+void StartupProfile::
+printSummary(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Phase> phases(phases_);
+    std::stable_sort(phases.begin(), phases.end(),
+                     [](const Phase& a, const Phase& b) {
+                         return a.start < b.start;
+                     });
+
+    const std::streamsize precision = out.precision();
+    const std::ios_base::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+    out << "Startup phases (ms from launch, duration):" << std::endl;
+    for (const auto& phase : phases) {
+        out << "  " << std::left << std::setw(24) << phase.name
+            << std::right << std::setw(9) << phase.start * 1000.0
+            << std::setw(9) << phase.duration * 1000.0;
+        if (phase.count > 1) {
+            out << " (" << phase.count << " calls)";
+        }
+        out << std::endl;
+    }
+    out.precision(precision);
+    out.flags(flags);
+}
+
+ScopedPhaseTimer::
+ScopedPhaseTimer(const char* name) : name_(name),
+                                     start_(StartupProfile::instance().elapsed()),
+                                     stopped_(false)
+{
+}
+
+ScopedPhaseTimer::
+~ScopedPhaseTimer()
+{
+    stop();
+}
+
+void ScopedPhaseTimer::
+stop()
+{
+    if (stopped_) {
+        return;
+    }
+    stopped_ = true;
+    StartupProfile& profile = StartupProfile::instance();
+    profile.addPhase(name_, start_, profile.elapsed() - start_);
+}
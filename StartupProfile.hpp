@@ -0,0 +1,102 @@
+/*
+ @file      StartupProfile.hpp
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+
+/**
+ Records how long each named phase of startup takes, measured from when
+ the profile is first used, so cold-start regressions can be tracked.
+ */
+class StartupProfile
+{
+public:
+
+    /**
+     The profile shared by the whole application.
+     */
+    static StartupProfile&
+    instance();
+
+    /**
+     Seconds since the profile was created.
+     */
+    double
+    elapsed() const;
+
+    /**
+     Adds a measured phase. Repeated phases of the same name accumulate
+     their durations and keep the start of the first.
+     */
+    void
+    addPhase(const std::string& name,
+             double start_seconds,
+             double duration_seconds);
+
+    /**
+     Adds a zero length phase marking a point in time.
+     */
+    void
+    mark(const std::string& name);
+
+    /**
+     @return  Boolean indicating success of the operation.
+     */
+    bool
+    writeJson(std::string filepath) const;
+
+    void
+    printSummary(std::ostream& out) const;
+
+private:
+
+    StartupProfile();
+    StartupProfile(const StartupProfile&);
+    StartupProfile& operator=(const StartupProfile&);
+
+    struct Phase
+    {
+        std::string name;
+        double start;
+        double duration;
+        int count;
+    };
+
+    std::chrono::high_resolution_clock::time_point start_time_;
+    std::vector<Phase> phases_;
+    mutable std::mutex mutex_;
+};
+
+/**
+ Adds the time between its construction and destruction to the shared
+ profile as the named phase.
+ */
+class ScopedPhaseTimer
+{
+public:
+
+    explicit ScopedPhaseTimer(const char* name);
+
+    ~ScopedPhaseTimer();
+
+    /**
+     Ends the phase early, for phases that do not match a scope.
+     */
+    void
+    stop();
+
+private:
+
+    ScopedPhaseTimer(const ScopedPhaseTimer&);
+    ScopedPhaseTimer& operator=(const ScopedPhaseTimer&);
+
+    const char* name_;
+    double start_;
+    bool stopped_;
+};
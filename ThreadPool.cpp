@@ -0,0 +1,108 @@
+#include "ThreadPool.hpp"
+#include <atomic>
+#include <algorithm>
+
+ThreadPool::
+ThreadPool(unsigned int thread_count) : busy_count_(0),
+                                        stopping_(false)
+{
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    threads_.reserve(thread_count);
+    for (unsigned int i=0; i<thread_count; ++i) {
+        threads_.push_back(std::thread(&ThreadPool::workerMain, this));
+    }
+}
+
+ThreadPool::
+~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    job_ready_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+unsigned int ThreadPool::
+threadCount() const
+{
+    return threads_.size();
+}
+
+void ThreadPool::
+run(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+    }
+    job_ready_.notify_one();
+}
+
+void ThreadPool::
+wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!jobs_.empty() || busy_count_ > 0) {
+        jobs_done_.wait(lock);
+    }
+}
+
+void ThreadPool::
+parallelFor(int count,
+            std::function<void(int)> task)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    // Each job pulls indices until none remain, so uneven tasks balance
+    // themselves across the workers.
+    std::atomic<int> next_index(0);
+    std::function<void()> job = [&next_index, count, &task]() {
+        for (int i = next_index++; i < count; i = next_index++) {
+            task(i);
+        }
+    };
+
+    const int job_count = std::min<int>(count, threads_.size());
+    for (int i=1; i<job_count; ++i) {
+        run(job);
+    }
+    job();
+    wait();
+}
+
+void ThreadPool::
+workerMain()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stopping_ && jobs_.empty()) {
+                job_ready_.wait(lock);
+            }
+            if (jobs_.empty()) {
+                return;
+            }
+            job = jobs_.front();
+            jobs_.pop_front();
+            ++busy_count_;
+        }
+        job();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --busy_count_;
+        }
+        jobs_done_.notify_all();
+    }
+}
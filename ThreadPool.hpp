@@ -0,0 +1,67 @@
+/*
+ @file      ThreadPool.hpp
+ */
+
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+/**
+ A fixed set of worker threads servicing a queue of jobs.
+ */
+class ThreadPool
+{
+public:
+
+    /**
+     @param thread_count  Number of workers, or zero to use one per
+                          hardware thread.
+     */
+    explicit ThreadPool(unsigned int thread_count = 0);
+
+    ~ThreadPool();
+
+    unsigned int
+    threadCount() const;
+
+    /**
+     Queues a job to run on the next free worker.
+     */
+    void
+    run(std::function<void()> job);
+
+    /**
+     Blocks until every queued job has finished.
+     */
+    void
+    wait();
+
+    /**
+     Calls task(i) for every i in [0, count) across the workers and the
+     calling thread, returning once all calls have finished.
+     */
+    void
+    parallelFor(int count,
+                std::function<void(int)> task);
+
+private:
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void
+    workerMain();
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable job_ready_;
+    std::condition_variable jobs_done_;
+    int busy_count_;
+    bool stopping_;
+};
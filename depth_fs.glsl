@@ -0,0 +1,6 @@
+#version 330
+
+// Only depth is written, with colour writes masked off
+void main(void)
+{
+}
@@ -0,0 +1,43 @@
+#version 330
+
+struct Light
+{
+    vec3 position;
+    float range;
+    vec3 intensity;
+};
+
+// Per-frame data shared with the sponza shaders; only the transform is
+// needed here
+layout(std140) uniform FrameData
+{
+    mat4 view_projection_xform;
+    vec3 camera_position;
+    vec3 ambient_intensity;
+    Light lights[7];
+};
+
+// The model data buffer laid out as for sponza_vs.glsl
+uniform samplerBuffer model_data;
+
+in vec3 position;
+
+// Advances once per instance, from the draw's base instance
+in int model_index;
+
+// Must match sponza_vs.glsl exactly for the main pass's equal depth test
+invariant gl_Position;
+
+void main(void)
+{
+	int base = model_index * 6;
+	mat4x3 model_xform = transpose(mat3x4(texelFetch(model_data, base),
+										  texelFetch(model_data, base + 1),
+										  texelFetch(model_data, base + 2)));
+	vec4 scale_compact = texelFetch(model_data, base + 4);
+	vec4 bias_checkered = texelFetch(model_data, base + 5);
+
+	vec3 local_position = position * scale_compact.xyz + bias_checkered.xyz;
+	vec3 world_position = model_xform * vec4(local_position, 1.0);
+	gl_Position = view_projection_xform * vec4(world_position, 1.0);
+}
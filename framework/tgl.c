@@ -6,6 +6,8 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <string.h>
+#define TGL_NO_TEXTURE_WRAPPERS
 #include "tgl.h"
 
 /* GL_version_1_0 */
@@ -412,6 +414,12 @@ PFNGLVERTEXATTRIBP3UIPROC glVertexAttribP3ui = 0;
 PFNGLVERTEXATTRIBP3UIVPROC glVertexAttribP3uiv = 0;
 PFNGLVERTEXATTRIBP4UIPROC glVertexAttribP4ui = 0;
 PFNGLVERTEXATTRIBP4UIVPROC glVertexAttribP4uiv = 0;
+/* ARB_draw_indirect */
+PFNGLDRAWARRAYSINDIRECTPROC glDrawArraysIndirect = 0;
+PFNGLDRAWELEMENTSINDIRECTPROC glDrawElementsIndirect = 0;
+/* ARB_multi_draw_indirect */
+PFNGLMULTIDRAWARRAYSINDIRECTPROC glMultiDrawArraysIndirect = 0;
+PFNGLMULTIDRAWELEMENTSINDIRECTPROC glMultiDrawElementsIndirect = 0;
 /* ARB_debug_output */
 PFNGLDEBUGMESSAGECONTROLARBPROC glDebugMessageControlARB = 0;
 PFNGLDEBUGMESSAGEINSERTARBPROC glDebugMessageInsertARB = 0;
@@ -435,6 +443,27 @@ static GLboolean tgl_extensions[TGL_EXTENSION_MAX];
 		ret = GL_FALSE;\
 	}
 
+/* query if the context is at least the given version or lists the extension,
+   as some drivers hand out entry points the context cannot use */
+static GLboolean _tglHasVersionOrExtension(GLint major,
+                                           GLint minor,
+                                           const char *name)
+{
+    GLint context_major = 0, context_minor = 0, count = 0, i;
+    glGetIntegerv(GL_MAJOR_VERSION, &context_major);
+    glGetIntegerv(GL_MINOR_VERSION, &context_minor);
+    if (context_major > major || (context_major == major && context_minor >= minor)) {
+        return GL_TRUE;
+    }
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (i=0; i<count; ++i) {
+        if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) {
+            return GL_TRUE;
+        }
+    }
+    return GL_FALSE;
+}
+
 /* callback to display GL debug messages */
 void _stdcall _tglDebugLog(GLenum source,
                            GLenum type,
@@ -979,6 +1008,23 @@ void tglInit(void) {
     LOADFUNC(PFNGLVERTEXATTRIBP3UIVPROC, glVertexAttribP3uiv, tgl_extensions[TGL_EXTENSION_GL_3_3])
     LOADFUNC(PFNGLVERTEXATTRIBP4UIPROC, glVertexAttribP4ui, tgl_extensions[TGL_EXTENSION_GL_3_3])
     LOADFUNC(PFNGLVERTEXATTRIBP4UIVPROC, glVertexAttribP4uiv, tgl_extensions[TGL_EXTENSION_GL_3_3])
+    /* ARB_draw_indirect */
+    if (_tglHasVersionOrExtension(4, 0, "GL_ARB_draw_indirect")) {
+        LOADFUNC(PFNGLDRAWARRAYSINDIRECTPROC, glDrawArraysIndirect, tgl_extensions[TGL_EXTENSION_ARB_DRAW_INDIRECT])
+        LOADFUNC(PFNGLDRAWELEMENTSINDIRECTPROC, glDrawElementsIndirect, tgl_extensions[TGL_EXTENSION_ARB_DRAW_INDIRECT])
+    } else {
+        tgl_extensions[TGL_EXTENSION_ARB_DRAW_INDIRECT] = GL_FALSE;
+    }
+    /* ARB_multi_draw_indirect, only offered with ARB_base_instance as
+       commands may not otherwise use a nonzero base instance */
+    if (tglIsAvailable(TGL_EXTENSION_ARB_DRAW_INDIRECT)
+        && _tglHasVersionOrExtension(4, 3, "GL_ARB_multi_draw_indirect")
+        && _tglHasVersionOrExtension(4, 2, "GL_ARB_base_instance")) {
+        LOADFUNC(PFNGLMULTIDRAWARRAYSINDIRECTPROC, glMultiDrawArraysIndirect, tgl_extensions[TGL_EXTENSION_ARB_MULTI_DRAW_INDIRECT])
+        LOADFUNC(PFNGLMULTIDRAWELEMENTSINDIRECTPROC, glMultiDrawElementsIndirect, tgl_extensions[TGL_EXTENSION_ARB_MULTI_DRAW_INDIRECT])
+    } else {
+        tgl_extensions[TGL_EXTENSION_ARB_MULTI_DRAW_INDIRECT] = GL_FALSE;
+    }
     /* ARB_debug_output */
     LOADFUNC(PFNGLDEBUGMESSAGECONTROLARBPROC, glDebugMessageControlARB, tgl_extensions[TGL_EXTENSION_ARB_DEBUG_OUTPUT])
     LOADFUNC(PFNGLDEBUGMESSAGEINSERTARBPROC, glDebugMessageInsertARB, tgl_extensions[TGL_EXTENSION_ARB_DEBUG_OUTPUT])
@@ -1041,3 +1087,354 @@ void tglDebugMessage(GLenum severity, const char *msg) {
     }
 #endif
 }
+
+/* state cache - shadow state, with ~0 for anything not yet known */
+
+#define TGL_CACHE_UNKNOWN 0xFFFFFFFFu
+#define TGL_CACHE_BUFFER_TARGETS 10
+#define TGL_CACHE_TEXTURE_UNITS 16
+#define TGL_CACHE_TEXTURE_TARGETS 10
+#define TGL_CACHE_UNIFORM_PROGRAMS 32
+#define TGL_CACHE_UNIFORM_LOCATIONS 64
+
+static GLboolean tgl_cache_enabled = GL_FALSE;
+static GLuint tgl_cache_program;
+static GLuint tgl_cache_vertex_array;
+static GLuint tgl_cache_buffers[TGL_CACHE_BUFFER_TARGETS];
+static GLuint tgl_cache_active_texture;
+static GLuint tgl_cache_textures[TGL_CACHE_TEXTURE_UNITS][TGL_CACHE_TEXTURE_TARGETS];
+/* uniform values as raw bits, per program and location */
+static GLuint tgl_cache_uniforms[TGL_CACHE_UNIFORM_PROGRAMS][TGL_CACHE_UNIFORM_LOCATIONS];
+static GLboolean tgl_cache_uniform_known[TGL_CACHE_UNIFORM_PROGRAMS][TGL_CACHE_UNIFORM_LOCATIONS];
+static GLuint tgl_cache_issued[TGL_STATE_CALL_MAX];
+static GLuint tgl_cache_elided[TGL_STATE_CALL_MAX];
+
+/* the loaded entry points the cache forwards to */
+static PFNGLUSEPROGRAMPROC tgl_real_glUseProgram;
+static PFNGLLINKPROGRAMPROC tgl_real_glLinkProgram;
+static PFNGLDELETEPROGRAMPROC tgl_real_glDeleteProgram;
+static PFNGLBINDVERTEXARRAYPROC tgl_real_glBindVertexArray;
+static PFNGLDELETEVERTEXARRAYSPROC tgl_real_glDeleteVertexArrays;
+static PFNGLBINDBUFFERPROC tgl_real_glBindBuffer;
+static PFNGLBINDBUFFERBASEPROC tgl_real_glBindBufferBase;
+static PFNGLBINDBUFFERRANGEPROC tgl_real_glBindBufferRange;
+static PFNGLDELETEBUFFERSPROC tgl_real_glDeleteBuffers;
+static PFNGLACTIVETEXTUREPROC tgl_real_glActiveTexture;
+static PFNGLUNIFORM1IPROC tgl_real_glUniform1i;
+static PFNGLUNIFORM1UIPROC tgl_real_glUniform1ui;
+static PFNGLUNIFORM1FPROC tgl_real_glUniform1f;
+
+/* slot of a buffer target in the shadow, or -1 if it is not shadowed */
+static int _tglBufferSlot(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER: return 0;
+    case GL_ELEMENT_ARRAY_BUFFER: return 1;
+    case GL_COPY_READ_BUFFER: return 2;
+    case GL_COPY_WRITE_BUFFER: return 3;
+    case GL_PIXEL_PACK_BUFFER: return 4;
+    case GL_PIXEL_UNPACK_BUFFER: return 5;
+    case GL_TEXTURE_BUFFER: return 6;
+    case GL_UNIFORM_BUFFER: return 7;
+    case GL_TRANSFORM_FEEDBACK_BUFFER: return 8;
+    case GL_DRAW_INDIRECT_BUFFER: return 9;
+    }
+    return -1;
+}
+
+/* slot of a texture target in the shadow, or -1 if it is not shadowed */
+static int _tglTextureSlot(GLenum target) {
+    switch (target) {
+    case GL_TEXTURE_1D: return 0;
+    case GL_TEXTURE_2D: return 1;
+    case GL_TEXTURE_3D: return 2;
+    case GL_TEXTURE_1D_ARRAY: return 3;
+    case GL_TEXTURE_2D_ARRAY: return 4;
+    case GL_TEXTURE_RECTANGLE: return 5;
+    case GL_TEXTURE_CUBE_MAP: return 6;
+    case GL_TEXTURE_BUFFER: return 7;
+    case GL_TEXTURE_2D_MULTISAMPLE: return 8;
+    case GL_TEXTURE_2D_MULTISAMPLE_ARRAY: return 9;
+    }
+    return -1;
+}
+
+static void _tglForgetUniforms(GLuint program) {
+    int i;
+    if (program < TGL_CACHE_UNIFORM_PROGRAMS) {
+        for (i=0; i<TGL_CACHE_UNIFORM_LOCATIONS; ++i) {
+            tgl_cache_uniform_known[program][i] = GL_FALSE;
+        }
+    }
+}
+
+/* whether the uniform call would change nothing; otherwise records the value */
+static GLboolean _tglUniformIsRedundant(GLint location, GLuint bits) {
+    const GLuint program = tgl_cache_program;
+    if (program == TGL_CACHE_UNKNOWN || program >= TGL_CACHE_UNIFORM_PROGRAMS
+        || location < 0 || location >= TGL_CACHE_UNIFORM_LOCATIONS) {
+        return GL_FALSE;
+    }
+    if (tgl_cache_uniform_known[program][location]
+        && tgl_cache_uniforms[program][location] == bits) {
+        return GL_TRUE;
+    }
+    tgl_cache_uniform_known[program][location] = GL_TRUE;
+    tgl_cache_uniforms[program][location] = bits;
+    return GL_FALSE;
+}
+
+static void APIENTRY _tglCachedUseProgram(GLuint program) {
+    if (program == tgl_cache_program) {
+        ++tgl_cache_elided[TGL_STATE_CALL_USE_PROGRAM];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_USE_PROGRAM];
+    tgl_cache_program = program;
+    tgl_real_glUseProgram(program);
+}
+
+static void APIENTRY _tglCachedLinkProgram(GLuint program) {
+    /* linking resets the program's uniforms to their defaults */
+    _tglForgetUniforms(program);
+    tgl_real_glLinkProgram(program);
+}
+
+static void APIENTRY _tglCachedDeleteProgram(GLuint program) {
+    _tglForgetUniforms(program);
+    tgl_real_glDeleteProgram(program);
+}
+
+static void APIENTRY _tglCachedBindVertexArray(GLuint array) {
+    if (array == tgl_cache_vertex_array) {
+        ++tgl_cache_elided[TGL_STATE_CALL_BIND_VERTEX_ARRAY];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_BIND_VERTEX_ARRAY];
+    tgl_cache_vertex_array = array;
+    /* the element array binding belongs to the vertex array */
+    tgl_cache_buffers[_tglBufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = TGL_CACHE_UNKNOWN;
+    tgl_real_glBindVertexArray(array);
+}
+
+static void APIENTRY _tglCachedDeleteVertexArrays(GLsizei n, const GLuint *arrays) {
+    GLsizei i;
+    for (i=0; i<n; ++i) {
+        if (arrays[i] != 0 && arrays[i] == tgl_cache_vertex_array) {
+            tgl_cache_vertex_array = 0;
+            tgl_cache_buffers[_tglBufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = TGL_CACHE_UNKNOWN;
+        }
+    }
+    tgl_real_glDeleteVertexArrays(n, arrays);
+}
+
+static void APIENTRY _tglCachedBindBuffer(GLenum target, GLuint buffer) {
+    const int slot = _tglBufferSlot(target);
+    if (slot >= 0 && tgl_cache_buffers[slot] == buffer) {
+        ++tgl_cache_elided[TGL_STATE_CALL_BIND_BUFFER];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_BIND_BUFFER];
+    if (slot >= 0) {
+        tgl_cache_buffers[slot] = buffer;
+    }
+    tgl_real_glBindBuffer(target, buffer);
+}
+
+/* indexed binds also replace the target's generic binding */
+static void APIENTRY _tglCachedBindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+    const int slot = _tglBufferSlot(target);
+    if (slot >= 0) {
+        tgl_cache_buffers[slot] = buffer;
+    }
+    tgl_real_glBindBufferBase(target, index, buffer);
+}
+
+static void APIENTRY _tglCachedBindBufferRange(GLenum target, GLuint index, GLuint buffer,
+                                               GLintptr offset, GLsizeiptr size) {
+    const int slot = _tglBufferSlot(target);
+    if (slot >= 0) {
+        tgl_cache_buffers[slot] = buffer;
+    }
+    tgl_real_glBindBufferRange(target, index, buffer, offset, size);
+}
+
+static void APIENTRY _tglCachedDeleteBuffers(GLsizei n, const GLuint *buffers) {
+    GLsizei i;
+    int slot;
+    for (i=0; i<n; ++i) {
+        for (slot=0; slot<TGL_CACHE_BUFFER_TARGETS; ++slot) {
+            if (buffers[i] != 0 && tgl_cache_buffers[slot] == buffers[i]) {
+                tgl_cache_buffers[slot] = 0;
+            }
+        }
+    }
+    tgl_real_glDeleteBuffers(n, buffers);
+}
+
+static void APIENTRY _tglCachedActiveTexture(GLenum texture) {
+    if (texture == tgl_cache_active_texture) {
+        ++tgl_cache_elided[TGL_STATE_CALL_ACTIVE_TEXTURE];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_ACTIVE_TEXTURE];
+    tgl_cache_active_texture = texture;
+    tgl_real_glActiveTexture(texture);
+}
+
+/* the binding is shadowed per unit, so the active unit must be known */
+void APIENTRY tglBindTexture(GLenum target, GLuint texture) {
+    const GLuint unit = tgl_cache_active_texture - GL_TEXTURE0;
+    const int slot = _tglTextureSlot(target);
+    if (!tgl_cache_enabled) {
+        glBindTexture(target, texture);
+        return;
+    }
+    if (slot >= 0 && unit < TGL_CACHE_TEXTURE_UNITS) {
+        if (tgl_cache_textures[unit][slot] == texture) {
+            ++tgl_cache_elided[TGL_STATE_CALL_BIND_TEXTURE];
+            return;
+        }
+        tgl_cache_textures[unit][slot] = texture;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_BIND_TEXTURE];
+    glBindTexture(target, texture);
+}
+
+void APIENTRY tglDeleteTextures(GLsizei n, const GLuint *textures) {
+    GLsizei i;
+    int unit, slot;
+    if (tgl_cache_enabled) {
+        for (i=0; i<n; ++i) {
+            for (unit=0; unit<TGL_CACHE_TEXTURE_UNITS; ++unit) {
+                for (slot=0; slot<TGL_CACHE_TEXTURE_TARGETS; ++slot) {
+                    if (textures[i] != 0 && tgl_cache_textures[unit][slot] == textures[i]) {
+                        tgl_cache_textures[unit][slot] = 0;
+                    }
+                }
+            }
+        }
+    }
+    glDeleteTextures(n, textures);
+}
+
+static void APIENTRY _tglCachedUniform1i(GLint location, GLint v0) {
+    if (_tglUniformIsRedundant(location, (GLuint)v0)) {
+        ++tgl_cache_elided[TGL_STATE_CALL_UNIFORM];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_UNIFORM];
+    tgl_real_glUniform1i(location, v0);
+}
+
+static void APIENTRY _tglCachedUniform1ui(GLint location, GLuint v0) {
+    if (_tglUniformIsRedundant(location, v0)) {
+        ++tgl_cache_elided[TGL_STATE_CALL_UNIFORM];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_UNIFORM];
+    tgl_real_glUniform1ui(location, v0);
+}
+
+static void APIENTRY _tglCachedUniform1f(GLint location, GLfloat v0) {
+    GLuint bits;
+    memcpy(&bits, &v0, sizeof(bits));
+    if (_tglUniformIsRedundant(location, bits)) {
+        ++tgl_cache_elided[TGL_STATE_CALL_UNIFORM];
+        return;
+    }
+    ++tgl_cache_issued[TGL_STATE_CALL_UNIFORM];
+    tgl_real_glUniform1f(location, v0);
+}
+
+void tglEnableStateCache(GLboolean enable) {
+    if (enable == tgl_cache_enabled) {
+        return;
+    }
+    if (enable) {
+        tgl_real_glUseProgram = glUseProgram;
+        tgl_real_glLinkProgram = glLinkProgram;
+        tgl_real_glDeleteProgram = glDeleteProgram;
+        tgl_real_glBindVertexArray = glBindVertexArray;
+        tgl_real_glDeleteVertexArrays = glDeleteVertexArrays;
+        tgl_real_glBindBuffer = glBindBuffer;
+        tgl_real_glBindBufferBase = glBindBufferBase;
+        tgl_real_glBindBufferRange = glBindBufferRange;
+        tgl_real_glDeleteBuffers = glDeleteBuffers;
+        tgl_real_glActiveTexture = glActiveTexture;
+        tgl_real_glUniform1i = glUniform1i;
+        tgl_real_glUniform1ui = glUniform1ui;
+        tgl_real_glUniform1f = glUniform1f;
+        glUseProgram = _tglCachedUseProgram;
+        glLinkProgram = _tglCachedLinkProgram;
+        glDeleteProgram = _tglCachedDeleteProgram;
+        glBindVertexArray = _tglCachedBindVertexArray;
+        glDeleteVertexArrays = _tglCachedDeleteVertexArrays;
+        glBindBuffer = _tglCachedBindBuffer;
+        glBindBufferBase = _tglCachedBindBufferBase;
+        glBindBufferRange = _tglCachedBindBufferRange;
+        glDeleteBuffers = _tglCachedDeleteBuffers;
+        glActiveTexture = _tglCachedActiveTexture;
+        glUniform1i = _tglCachedUniform1i;
+        glUniform1ui = _tglCachedUniform1ui;
+        glUniform1f = _tglCachedUniform1f;
+        tglInvalidateStateCache();
+    } else {
+        glUseProgram = tgl_real_glUseProgram;
+        glLinkProgram = tgl_real_glLinkProgram;
+        glDeleteProgram = tgl_real_glDeleteProgram;
+        glBindVertexArray = tgl_real_glBindVertexArray;
+        glDeleteVertexArrays = tgl_real_glDeleteVertexArrays;
+        glBindBuffer = tgl_real_glBindBuffer;
+        glBindBufferBase = tgl_real_glBindBufferBase;
+        glBindBufferRange = tgl_real_glBindBufferRange;
+        glDeleteBuffers = tgl_real_glDeleteBuffers;
+        glActiveTexture = tgl_real_glActiveTexture;
+        glUniform1i = tgl_real_glUniform1i;
+        glUniform1ui = tgl_real_glUniform1ui;
+        glUniform1f = tgl_real_glUniform1f;
+    }
+    tgl_cache_enabled = enable;
+}
+
+void tglInvalidateStateCache(void) {
+    int i, j;
+    tgl_cache_program = TGL_CACHE_UNKNOWN;
+    tgl_cache_vertex_array = TGL_CACHE_UNKNOWN;
+    for (i=0; i<TGL_CACHE_BUFFER_TARGETS; ++i) {
+        tgl_cache_buffers[i] = TGL_CACHE_UNKNOWN;
+    }
+    tgl_cache_active_texture = TGL_CACHE_UNKNOWN;
+    for (i=0; i<TGL_CACHE_TEXTURE_UNITS; ++i) {
+        for (j=0; j<TGL_CACHE_TEXTURE_TARGETS; ++j) {
+            tgl_cache_textures[i][j] = TGL_CACHE_UNKNOWN;
+        }
+    }
+    for (i=0; i<TGL_CACHE_UNIFORM_PROGRAMS; ++i) {
+        _tglForgetUniforms(i);
+    }
+}
+
+void tglGetStateCacheCounts(TGLSTATECALL call, GLuint *issued, GLuint *elided) {
+    *issued = tgl_cache_issued[call];
+    *elided = tgl_cache_elided[call];
+}
+
+void tglResetStateCacheCounts(void) {
+    int i;
+    for (i=0; i<TGL_STATE_CALL_MAX; ++i) {
+        tgl_cache_issued[i] = 0;
+        tgl_cache_elided[i] = 0;
+    }
+}
+
+const char* tglStateCallName(TGLSTATECALL call) {
+    switch (call) {
+    case TGL_STATE_CALL_USE_PROGRAM: return "glUseProgram";
+    case TGL_STATE_CALL_BIND_VERTEX_ARRAY: return "glBindVertexArray";
+    case TGL_STATE_CALL_BIND_BUFFER: return "glBindBuffer";
+    case TGL_STATE_CALL_ACTIVE_TEXTURE: return "glActiveTexture";
+    case TGL_STATE_CALL_BIND_TEXTURE: return "glBindTexture";
+    case TGL_STATE_CALL_UNIFORM: return "glUniform1";
+    default: return "unknown";
+    }
+}
@@ -74,6 +74,8 @@ typedef enum _TGLEXTENTION {
     TGL_EXTENSION_GL_3_1,
     TGL_EXTENSION_GL_3_2,
     TGL_EXTENSION_GL_3_3,
+    TGL_EXTENSION_ARB_DRAW_INDIRECT,
+    TGL_EXTENSION_ARB_MULTI_DRAW_INDIRECT,
     TGL_EXTENSION_ARB_DEBUG_OUTPUT,
     TGL_EXTENSION_AMD_DEBUG_OUTPUT,
     TGL_EXTENSION_MAX
@@ -94,6 +96,37 @@ GLboolean tglIsAvailable(TGLEXTENSION);
 /** Log a debug message */
 void tglDebugMessage(GLenum severity, const char *msg);
 
+/** Kinds of call filtered by the state cache. */
+typedef enum _TGLSTATECALL {
+    TGL_STATE_CALL_USE_PROGRAM,
+    TGL_STATE_CALL_BIND_VERTEX_ARRAY,
+    TGL_STATE_CALL_BIND_BUFFER,
+    TGL_STATE_CALL_ACTIVE_TEXTURE,
+    TGL_STATE_CALL_BIND_TEXTURE,
+    TGL_STATE_CALL_UNIFORM,
+    TGL_STATE_CALL_MAX
+} TGLSTATECALL;
+
+/**
+ * Route glUseProgram, glBindVertexArray, glBindBuffer, glActiveTexture,
+ * glBindTexture and scalar glUniform calls through a shadow copy of GL state
+ * which drops those that would not change it. Call after tglInit. The shadow
+ * starts empty, so the first call of each kind always reaches GL.
+ */
+void tglEnableStateCache(GLboolean enable);
+
+/** Forget the shadowed state, after GL state was changed behind its back. */
+void tglInvalidateStateCache(void);
+
+/** Calls of a kind passed on to GL and dropped since the counts were reset. */
+void tglGetStateCacheCounts(TGLSTATECALL call, GLuint *issued, GLuint *elided);
+
+/** Zero every state cache count. */
+void tglResetStateCacheCounts(void);
+
+/** Name of the GL function a kind of call stands for. */
+const char* tglStateCallName(TGLSTATECALL call);
+
 /* GL_version_1_0 */
 #ifdef TGL_PROTOTYPES_GL_1_0
 extern PFNGLCULLFACEPROC glCullFace;
@@ -226,6 +259,13 @@ GLAPI void APIENTRY glDeleteTextures (GLsizei n, const GLuint *textures);
 GLAPI void APIENTRY glGenTextures (GLsizei n, GLuint *textures);
 GLAPI GLboolean APIENTRY glIsTexture (GLuint texture);
 #endif
+/* texture binds reach the state cache through tgl's own entry points */
+void APIENTRY tglBindTexture(GLenum target, GLuint texture);
+void APIENTRY tglDeleteTextures(GLsizei n, const GLuint *textures);
+#ifndef TGL_NO_TEXTURE_WRAPPERS
+#define glBindTexture tglBindTexture
+#define glDeleteTextures tglDeleteTextures
+#endif
 /* GL_version_1_2 */
 extern PFNGLBLENDCOLORPROC glBlendColor;
 extern PFNGLBLENDEQUATIONPROC glBlendEquation;
@@ -562,6 +602,22 @@ extern PFNGLVERTEXATTRIBP3UIPROC glVertexAttribP3ui;
 extern PFNGLVERTEXATTRIBP3UIVPROC glVertexAttribP3uiv;
 extern PFNGLVERTEXATTRIBP4UIPROC glVertexAttribP4ui;
 extern PFNGLVERTEXATTRIBP4UIVPROC glVertexAttribP4uiv;
+/* ARB_draw_indirect - copied from glcorearb.h for headers predating GL 4.0 */
+#ifndef GL_VERSION_4_0
+#define GL_DRAW_INDIRECT_BUFFER           0x8F3F
+#define GL_DRAW_INDIRECT_BUFFER_BINDING   0x8F43
+typedef void (APIENTRYP PFNGLDRAWARRAYSINDIRECTPROC) (GLenum mode, const GLvoid *indirect);
+typedef void (APIENTRYP PFNGLDRAWELEMENTSINDIRECTPROC) (GLenum mode, GLenum type, const GLvoid *indirect);
+#endif
+extern PFNGLDRAWARRAYSINDIRECTPROC glDrawArraysIndirect;
+extern PFNGLDRAWELEMENTSINDIRECTPROC glDrawElementsIndirect;
+/* ARB_multi_draw_indirect - copied from glcorearb.h for headers predating GL 4.3 */
+#ifndef GL_VERSION_4_3
+typedef void (APIENTRYP PFNGLMULTIDRAWARRAYSINDIRECTPROC) (GLenum mode, const void *indirect, GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSINDIRECTPROC) (GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
+#endif
+extern PFNGLMULTIDRAWARRAYSINDIRECTPROC glMultiDrawArraysIndirect;
+extern PFNGLMULTIDRAWELEMENTSINDIRECTPROC glMultiDrawElementsIndirect;
 /* ARB_debug_output */
 extern PFNGLDEBUGMESSAGECONTROLARBPROC glDebugMessageControlARB;
 extern PFNGLDEBUGMESSAGEINSERTARBPROC glDebugMessageInsertARB;
@@ -3,12 +3,16 @@
 
 #include "Window.hpp"
 #include "MyController.hpp"
+#include "StartupProfile.hpp"
 
 int main(int argc, char *argv[])
 {
     // enable debug memory checks
     _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
 
+    // phases are timed from here
+    StartupProfile::instance().mark("launch");
+
     std::shared_ptr<MyController> controller(new MyController());
     std::shared_ptr<tyga::Window> window = tyga::Window::mainWindow();
     window->setController(controller);
@@ -17,7 +21,11 @@ int main(int argc, char *argv[])
     const int window_height = 576;
     const int number_of_samples = 4;
 
-    if (window->open(window_width, window_height, number_of_samples, true)) {
+    ScopedPhaseTimer open_timer("window_open");
+    const bool window_open = window->open(window_width, window_height,
+                                          number_of_samples, true);
+    open_timer.stop();
+    if (window_open) {
         while (window->isVisible()) {
             window->update();
         }
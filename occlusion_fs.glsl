@@ -0,0 +1,10 @@
+#version 330
+
+// Colour writes are masked off while boxes are drawn, leaving only the
+// depth test to count samples
+out vec4 fragment_colour;
+
+void main(void)
+{
+	fragment_colour = vec4(1.0);
+}
@@ -0,0 +1,30 @@
+#version 330
+
+struct Light
+{
+    vec3 position;
+    float range;
+    vec3 intensity;
+};
+
+// Per-frame data shared with the sponza shaders; only the transform is
+// needed here
+layout(std140) uniform FrameData
+{
+    mat4 view_projection_xform;
+    vec3 camera_position;
+    vec3 ambient_intensity;
+    Light lights[7];
+};
+
+// World space box of the model being tested
+uniform vec3 box_min;
+uniform vec3 box_max;
+
+// Corner of the unit cube
+in vec3 position;
+
+void main(void)
+{
+	gl_Position = view_projection_xform * vec4(mix(box_min, box_max, position), 1.0);
+}
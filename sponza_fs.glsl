@@ -7,17 +7,23 @@ struct Light
     vec3 intensity;
 };
 
-uniform vec3 camera_position;
-uniform vec3 material_colour;
+// Per-frame data shared with the vertex shader, uploaded once a frame
+layout(std140) uniform FrameData
+{
+    mat4 view_projection_xform;
+    vec3 camera_position;
+    vec3 ambient_intensity;
+    Light lights[7];
+};
+
 uniform sampler2D shininess_texture;
-uniform Light lights[7];
-uniform vec3 ambient_intensity;
-uniform int specularOn;
-uniform int checkered;
 
 in vec3 world_normal;
 in vec2 text_coord;
 in vec3 world_position;
+flat in vec3 material_colour;
+flat in int specularOn;
+flat in int checkered;
 
 out vec4 fragment_colour;
 
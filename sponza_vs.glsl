@@ -1,20 +1,77 @@
 #version 330
 
-uniform mat4 model_xform;
-uniform mat4 combined_xform;
+struct Light
+{
+    vec3 position;
+    float range;
+    vec3 intensity;
+};
+
+// Per-frame data shared with the fragment shader, uploaded once a frame
+layout(std140) uniform FrameData
+{
+    mat4 view_projection_xform;
+    vec3 camera_position;
+    vec3 ambient_intensity;
+    Light lights[7];
+};
+
+// Six texels per model, see MyView::ModelData:
+//   0-2  rows of the model transform
+//   3    material colour, and 1 in w when the shininess map is bound
+//   4    position scale, and 1 in w for compact vertices
+//   5    position bias, and 1 in w to draw checkered
+// Compact vertices hold positions quantised to the mesh bounds and
+// octahedral encoded normals
+uniform samplerBuffer model_data;
 
 in vec3 position;
 in vec3 normal;
 in vec2 texture_coord;
 
+// Advances once per instance, from the draw's base instance
+in int model_index;
+
 out vec3 world_normal;
 out vec2 text_coord;
 out vec3 world_position;
+flat out vec3 material_colour;
+flat out int specularOn;
+flat out int checkered;
+
+// Matched by depth_vs.glsl, whose depth the pre-pass tests for equality
+invariant gl_Position;
+
+vec3 octahedralDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+	{
+		vec2 signs = mix(vec2(-1.0), vec2(1.0), greaterThanEqual(n.xy, vec2(0.0)));
+		n.xy = (1.0 - abs(n.yx)) * signs;
+	}
+	return normalize(n);
+}
 
 void main(void)
 {
+	int base = model_index * 6;
+	mat4x3 model_xform = transpose(mat3x4(texelFetch(model_data, base),
+										  texelFetch(model_data, base + 1),
+										  texelFetch(model_data, base + 2)));
+	vec4 colour_specular = texelFetch(model_data, base + 3);
+	vec4 scale_compact = texelFetch(model_data, base + 4);
+	vec4 bias_checkered = texelFetch(model_data, base + 5);
+
+	material_colour = colour_specular.rgb;
+	specularOn = int(colour_specular.w);
+	checkered = int(bias_checkered.w);
+
+	vec3 local_position = position * scale_compact.xyz + bias_checkered.xyz;
+	vec3 local_normal = scale_compact.w == 1.0 ? octahedralDecode(normal.xy) : normal;
+
 	text_coord = texture_coord;
-	world_normal = mat3(model_xform) * normal;
-	world_position = mat4x3(model_xform) * vec4(position, 1.0);
-    gl_Position = combined_xform * vec4(position, 1.0);
+	world_normal = mat3(model_xform) * local_normal;
+	world_position = model_xform * vec4(local_position, 1.0);
+    gl_Position = view_projection_xform * vec4(world_position, 1.0);
 }